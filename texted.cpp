@@ -1,632 +1,6336 @@
 #include <iostream>
 #include <stack>
 #include <vector>
-#include <conio.h>      // For _getch() and _kbhit()
-#include <windows.h>    // For SetConsoleCursorPosition()
+#include <termios.h>    // For raw terminal input
+#include <unistd.h>     // For read() and write()
+#include <poll.h>       // For waiting on keyboard input
+#include <sys/ioctl.h>  // For the terminal window size
+#include <sys/mman.h>   // For mapping the dictionary image
+#include <sys/stat.h>
+#include <sys/uio.h>    // For writev()
+#include <sys/socket.h> // For the spellcheck server
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h> // For getrusage()
+#include <fcntl.h>
+#include <climits>      // For IOV_MAX
+#ifdef __SSE2__
+#include <emmintrin.h>  // For scanning text 16 bytes at a time
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>  // For __rdtsc()
+#endif
+#include <cmath>        // For ceil()
+#include <csignal>
 #include <fstream>
 #include <cctype>       // For isspace() and toupper()
+#include <cstring>      // For memmove()
 #include <unordered_map>
+#include <map>
+#include <memory>
+#include <deque>
 #include <algorithm>
+#include <numeric>      // For accumulate()
+#include <random>       // For the benchmarks' synthetic text
 #include<sstream>
+#include <chrono>
+#include <cstdint>
+#include <tuple>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cerrno>
+#include <atomic>
+#include <functional>
 using namespace std;
-const int MAX_HISTORY = 100; // Limit for undo history
-const int DEFAULT_CONSOLE_COLOR = 7; 
+const size_t MAX_UNDO_BYTES = 16 * 1024 * 1024; // Limit for undo history, in bytes of edited text
+const int DEFAULT_CONSOLE_COLOR = 7;
 const int HIGHLIGHT_COLOR = 10; // Suggestion highlight color (Green)
+const int ESCAPE_WAIT_MS = 30; // How long to wait for the rest of an escape sequence
+const int PASTE_WAIT_MS = 500; // How long a paste may stall before what has arrived is used
+const int PASTE_KEY = 256; // Code nextKey() returns for a bracketed paste, whose text is in pastedText()
+const int FRAME_INTERVAL_MS = 16; // Redraw at most this often (about 60 frames a second)
+const int WORD_COUNT_EXPORT_MS = 500; // Minimum time between rewrites of word_count.txt
+const size_t CHECK_BLOCK_BYTES = 1 << 20; // Text read and handed to a spellcheck thread at a time
+const size_t SPELL_CACHE_LINES = 4096; // Checked lines remembered by the editor before the cache is reset
+const size_t SAVE_BATCH_BYTES = 4 << 20; // Text handed to one writev() call when saving
+const int JOURNAL_SYNC_MS = 200; // Edits are written to the crash journal and synced this often
+const uint64_t JOURNAL_CHECKPOINT_BYTES = 16 << 20; // Journal size that triggers writing a checkpoint
+const unsigned SERVE_MAX_THREADS = 4; // Most threads --serve answers queries on
+const size_t SERVE_OUTPUT_LIMIT = 1 << 20; // Unread answers a client may have before its queries wait
+const size_t QUERY_BATCH = 256; // Queries --query sends before reading their answers
+const size_t USER_WORDS_MERGE = 256; // User words kept beside the dictionary trie before they are merged into it
+const int COMPLETION_BUDGET_US = 250; // Time ranking completions may take per key before sources are left out
+const size_t COMPLETION_MIN_PREFIX = 2; // Letters typed before a completion is offered
+const size_t COMPLETION_SCAN = 512; // Document words sharing the prefix looked at per query
+const size_t COMPLETION_FOLLOWERS = 16; // Words remembered after each word, to rank by the word before
+const size_t COMPLETION_CONTEXT_BYTES = 64; // Text before the cursor read again after the cursor jumps
+const size_t COMPLETION_TYPED_BYTES = 4096; // Larger inserts are learned in the background instead of as typed
+const size_t COMPLETION_LEARN_BYTES = 16 << 20; // Most of an opened file that is learned for completions
 
-// Spellchecker and Auto-Suggest 
+// Spellchecker and Auto-Suggest
 
-struct Node {
-    Node* links[26];
-    bool endOfWord;
+// One trie node, 8 bytes. Nodes live in one contiguous array and the
+// children of a node are stored next to each other in letter order, so a
+// node needs one index and a bitmask instead of 26 pointers: the child for a
+// letter sits at firstChild plus the number of smaller letters present.
+struct TrieNode {
+    static const uint32_t LETTERS = (1u << 26) - 1;  // Bit i: there is a child for 'a' + i
+    static const uint32_t END_OF_WORD = 1u << 26;
 
-    Node() : endOfWord(false) {
-        fill(begin(links), end(links), nullptr);
+    uint32_t firstChild = 0;  // Index of the first child in the node array
+    uint32_t bits = 0;
+
+    bool endOfWord() const {
+        return bits & END_OF_WORD;
     }
 };
 
+// Layout of a prebuilt dictionary image: this header followed by the
+// sections of the dictionary exactly as they sit in memory (nodes, reversed
+// nodes, top-k offsets, top-k lists, word offsets, word weights, word text). Everything
+// refers to everything else by index, so the image can be mapped at any
+// address and used without parsing.
+struct DictionaryImageHeader {
+    char magic[8];            // "TXDICT3"
+    uint32_t nodeSize;        // sizeof(TrieNode), guards against layout changes
+    uint32_t topK;            // Length of the longest ranked list kept per node
+    uint32_t nodeCount;
+    uint32_t reverseCount;    // Nodes in the trie of reversed words
+    uint32_t wordCount;
+    uint32_t topCount;        // Entries across all ranked lists
+    uint32_t textBytes;
+    uint64_t sourceSize;      // Size of the word list the image was built from
+    int64_t sourceModified;   // Modification time of that word list
+};
+
+const char DICTIONARY_IMAGE_MAGIC[8] = "TXDICT3";
+const int DEFAULT_SUGGESTIONS = 5; // Completions kept per prefix unless configured otherwise
+
+// How often the user wrote each dictionary word; such words rank higher in suggestions
+typedef map<string, uint32_t> WordCounts;
+
 class Dictionary {
-public:
-    Node* base;
+private:
+    // The trie in use. These point either at the owned vectors below or
+    // into a mapped image.
+    const TrieNode* nodes;       // The root is nodes[0]
+    size_t nodeCount;
+    const uint32_t* topOffset;   // Node n's entries are topList[topOffset[n] .. topOffset[n + 1])
+    const uint32_t* topList;     // Word ids: the node's own word if it ends one, then the best words below it
+    size_t topCount;
+    const uint32_t* wordOffset;  // Word w is wordText[wordOffset[w] .. wordOffset[w + 1]), ids are alphabetical
+    const uint32_t* wordWeight;  // How common each word is
+    const char* wordText;
+    size_t wordCount;
+    const TrieNode* reverseNodes; // Every word spelt backwards, for spelling corrections
+    size_t reverseCount;
 
-    Dictionary() {
-        base = new Node();
+    // Arena holding the sections when they were built here
+    vector<TrieNode> ownedNodes, ownedReverseNodes;
+    vector<uint32_t> ownedTopOffset, ownedTopList, ownedWordOffset, ownedWordWeight;
+    string ownedWordText;
+
+    void* mapping = nullptr;     // Mapped image, if the trie came from one
+    size_t mappingSize = 0;
+    int topK = DEFAULT_SUGGESTIONS;
+    vector<pair<string, uint32_t>> staged;   // Words and weights added since the last build
+
+    // Child of node for letter c (a-z), or -1
+    int child(int node, char c) const {
+        uint32_t letter = 1u << (c - 'a');
+        const TrieNode& parent = nodes[node];
+        if (!(parent.bits & letter)) return -1;
+        return parent.firstChild + __builtin_popcount(parent.bits & (letter - 1));
     }
 
-    // Add word to the dictionary
-    void addWord(const string& text) {
-        Node* current = base;
+    // Node reached by following text from the root, or -1
+    int find(const string& text) const {
+        int current = 0;
         for (char c : text) {
-            if (!islower(c)) continue;
-            int idx = c - 'a';
-            if (idx < 0 || idx >= 26) continue;
+            if (c < 'a' || c > 'z') return -1;
+            current = child(current, c);
+            if (current < 0) return -1;
+        }
+        return current;
+    }
+
+    string wordAt(uint32_t id) const {
+        return string(wordText + wordOffset[id], wordOffset[id + 1] - wordOffset[id]);
+    }
+
+    // Whether word a ranks above word b: heavier first, then alphabetical
+    bool ranksAbove(uint32_t a, uint32_t b) const {
+        return wordWeight[a] != wordWeight[b] ? wordWeight[a] > wordWeight[b] : a < b;
+    }
 
-            if (current->links[idx] == nullptr) {
-                current->links[idx] = new Node();
+    void useOwnedSections() {
+        unmap();
+        nodes = ownedNodes.data();
+        nodeCount = ownedNodes.size();
+        topOffset = ownedTopOffset.data();
+        topList = ownedTopList.data();
+        topCount = ownedTopList.size();
+        wordOffset = ownedWordOffset.data();
+        wordWeight = ownedWordWeight.data();
+        wordText = ownedWordText.data();
+        wordCount = ownedWordWeight.size();
+        reverseNodes = ownedReverseNodes.data();
+        reverseCount = ownedReverseNodes.size();
+    }
+
+    // Lay out a trie of words sorted alphabetically without duplicates. A
+    // node's children are placed as one block, and blocks are allocated
+    // depth first so that a word's path stays in a small part of the array.
+    // nodeWord receives the index of the word ending at each node, or -1.
+    static void layOut(const vector<string>& words, vector<TrieNode>& nodes, vector<int>& nodeWord) {
+        struct Range { uint32_t node; size_t lo, hi, depth; };
+        nodes.assign(1, TrieNode());
+        nodeWord.assign(1, -1);
+        vector<Range> pending = {{0, 0, words.size(), 0}};
+        while (!pending.empty()) {
+            Range range = pending.back();
+            pending.pop_back();
+            size_t i = range.lo;
+            // Sorted order puts the word that ends here first
+            if (i < range.hi && words[i].size() == range.depth) {
+                nodes[range.node].bits |= TrieNode::END_OF_WORD;
+                nodeWord[range.node] = i;
+                i++;
             }
-            current = current->links[idx];
+            nodes[range.node].firstChild = nodes.size();
+            size_t firstPending = pending.size();
+            while (i < range.hi) {
+                char label = words[i][range.depth];
+                size_t end = i;
+                while (end < range.hi && words[end][range.depth] == label) end++;
+                nodes.push_back(TrieNode());
+                nodeWord.push_back(-1);
+                nodes[range.node].bits |= 1u << (label - 'a');
+                pending.push_back({(uint32_t)nodes.size() - 1, i, end, range.depth + 1});
+                i = end;
+            }
+            reverse(pending.begin() + firstPending, pending.end());  // Visit the first letter next
         }
-        current->endOfWord = true;
+        nodes.shrink_to_fit();
     }
 
-    // Check if word exists
-    bool exists(const string& text) {
-        Node* current = base;
-        for (char c : text) {
-            int idx = c - 'a';
-            if (idx < 0 || idx >= 26 || current->links[idx] == nullptr)
-                return false;
-            current = current->links[idx];
+    // Build a fresh dictionary from words sorted alphabetically without
+    // duplicates. Each node of the trie gets the topK heaviest words below
+    // it, so a prefix query never has to search the subtree, and a second
+    // trie of the words spelt backwards is kept for spelling corrections.
+    void buildFrom(const vector<pair<string, uint32_t>>& words) {
+        ownedWordOffset.assign(1, 0);
+        ownedWordWeight.clear();
+        ownedWordText.clear();
+        vector<string> spellings, reversed;
+        for (auto& entry : words) {
+            ownedWordText += entry.first;
+            ownedWordOffset.push_back(ownedWordText.size());
+            ownedWordWeight.push_back(entry.second);
+            spellings.push_back(entry.first);
+            reversed.emplace_back(entry.first.rbegin(), entry.first.rend());
+        }
+        wordOffset = ownedWordOffset.data();
+        wordWeight = ownedWordWeight.data();
+
+        vector<int> nodeWord, unused;
+        sort(reversed.begin(), reversed.end());
+        layOut(reversed, ownedReverseNodes, unused);
+        layOut(spellings, ownedNodes, nodeWord);
+        vector<TrieNode>& nodes = ownedNodes;
+
+        // Children always come after their parent, so walking backwards
+        // finishes every child's list before its parent needs it
+        vector<vector<uint32_t>> best(nodes.size());
+        auto byRank = [this](uint32_t a, uint32_t b) { return ranksAbove(a, b); };
+        for (size_t n = nodes.size(); n-- > 0;) {
+            vector<uint32_t>& list = best[n];
+            if (nodeWord[n] >= 0) list.push_back(nodeWord[n]);
+            uint32_t c = nodes[n].firstChild;
+            for (uint32_t letters = nodes[n].bits & TrieNode::LETTERS; letters; letters &= letters - 1, ++c) {
+                list.insert(list.end(), best[c].begin(), best[c].end());
+            }
+            size_t keep = min<size_t>(list.size(), topK);
+            partial_sort(list.begin(), list.begin() + keep, list.end(), byRank);
+            list.resize(keep);
+            list.shrink_to_fit();
         }
-        return current->endOfWord;
+        ownedTopOffset.assign(1, 0);
+        ownedTopList.clear();
+        for (size_t n = 0; n < nodes.size(); ++n) {
+            const vector<uint32_t>& list = best[n];
+            if (nodeWord[n] >= 0) ownedTopList.push_back(nodeWord[n]);
+            ownedTopList.insert(ownedTopList.end(), list.begin(), list.end());
+            ownedTopOffset.push_back(ownedTopList.size());
+        }
+        useOwnedSections();
     }
 
-    // Helper for recursive suggestion collection
-    void fetchSuggestions(Node* current, string& prefix, vector<string>& results) {
-        if (current->endOfWord) results.push_back(prefix);
+    // State shared by the steps of a correction search
+    struct CorrectionSearch {
+        const TrieNode* trie;            // Trie being walked
+        string word;                     // Misspelt word, spelt the same way as the trie
+        int maxDistance;
+        vector<int> budget;              // Edits allowed for the first i letters of the word
+        string path;                     // Letters from the root to the current node
+        int stride;                      // Entries per row of the table
+        vector<int> rows;                // Edit distance table, one row per depth
+        vector<pair<int, string>> found; // Distance and spelling of every match
+    };
+
+    // Walk the trie below node, extending the edit distance table one row
+    // per letter (optimal string alignment, so a swap of two neighbouring
+    // letters costs 1). Only the band of the row within maxDistance of the
+    // diagonal can stay in range, so that is all that is computed. A branch
+    // is abandoned once no entry of its row is within the budget for its
+    // column. (A swap skips a row of the path, but the skipped row always
+    // has an entry matching the one before it.) Once no slack is left, only
+    // letters that continue the word are tried.
+    void searchCorrections(CorrectionSearch& search, int node, int depth) const {
+        const TrieNode* trie = search.trie;
+        const char* word = search.word.data();
+        const int length = search.word.size();
+        const int limit = search.maxDistance;
+        const int* budget = search.budget.data();
+        const int* previous = search.rows.data() + depth * search.stride;
+        if (trie[node].endOfWord() && abs(depth - length) <= limit && previous[length] <= limit) {
+            search.found.push_back({previous[length], search.path});
+        }
+        if (depth >= length + limit) return;
+        int* row = search.rows.data() + (depth + 1) * search.stride;
+        const int* before = depth > 0 ? previous - search.stride : nullptr;
+        const char last = depth > 0 ? search.path[depth - 1] : 0;
+        const int lo = max(1, depth + 1 - limit), hi = min(length, depth + 1 + limit);
+        const int widest = budget[hi];
+
+        const uint32_t allLetters = trie[node].bits & TrieNode::LETTERS;
+        uint32_t letters = allLetters;
+        bool slack = depth + 1 <= widest;
+        for (int i = lo - 1; i <= hi && !slack; ++i) slack = previous[i] < widest;
+        if (!slack) {
+            uint32_t matching = 0;
+            for (int i = lo; i <= hi; ++i) {
+                if (previous[i - 1] <= widest) matching |= 1u << (word[i - 1] - 'a');
+                if (i > 1 && word[i - 1] == last && before[i - 2] < widest) matching |= 1u << (word[i - 2] - 'a');
+            }
+            letters &= matching;
+        }
 
-        for (int i = 0; i < 26 && results.size() < 5; ++i) {
-            if (current->links[i] != nullptr) {
-                prefix.push_back('a' + i);
-                fetchSuggestions(current->links[i], prefix, results);
-                prefix.pop_back();
+        for (; letters; letters &= letters - 1) {
+            const char c = 'a' + __builtin_ctz(letters);
+            row[0] = depth + 1 <= limit ? depth + 1 : limit + 1;
+            row[lo - 1] = lo > 1 ? limit + 1 : row[0];
+            if (hi < length) row[hi + 1] = limit + 1;
+            bool inBudget = row[0] <= budget[0];
+            for (int i = lo; i <= hi; ++i) {
+                int cost = min(previous[i] + 1, row[i - 1] + 1);
+                cost = min(cost, previous[i - 1] + (word[i - 1] != c));
+                if (i > 1 && word[i - 1] == last && word[i - 2] == c) cost = min(cost, before[i - 2] + 1);
+                row[i] = cost;
+                inBudget |= cost <= budget[i];
             }
+            if (!inBudget) continue;
+            uint32_t next = trie[node].firstChild + __builtin_popcount(allLetters & ((letters & -letters) - 1));
+            search.path.push_back(c);
+            searchCorrections(search, next, depth + 1);
+            search.path.pop_back();
+        }
+    }
+
+    // Add the words of trie within maxDistance of word to search.found,
+    // skipping those that spend more than firstEdits on its first
+    // firstLetters letters
+    void searchCorrections(CorrectionSearch& search, const TrieNode* trie, const string& word,
+                           int maxDistance, int firstLetters, int firstEdits) const {
+        search.trie = trie;
+        search.word = word;
+        search.maxDistance = maxDistance;
+        search.budget.assign(word.size() + 1, maxDistance);
+        fill(search.budget.begin(), search.budget.begin() + min<size_t>(firstLetters + 1, word.size() + 1), firstEdits);
+        search.stride = word.size() + 1;
+        search.rows.assign((word.size() + maxDistance + 1) * search.stride, 0);
+        for (size_t i = 0; i <= word.size(); ++i) search.rows[i] = min<int>(i, maxDistance + 1);
+        vector<pair<int, string>> found;
+        found.swap(search.found);
+        searchCorrections(search, 0, 0);
+        if (trie == reverseNodes) {
+            for (auto& match : search.found) reverse(match.second.begin(), match.second.end());
+        }
+        search.found.insert(search.found.end(), found.begin(), found.end());
+    }
+
+    void unmap() {
+        if (mapping) munmap(mapping, mappingSize);
+        mapping = nullptr;
+        mappingSize = 0;
+    }
+
+public:
+    Dictionary() {
+        buildFrom({});
+    }
+
+    Dictionary(const Dictionary&) = delete;
+    Dictionary& operator=(const Dictionary&) = delete;
+
+    // The arena is owned by value; only a mapped image needs releasing
+    ~Dictionary() {
+        unmap();
+    }
+
+    // Set how many ranked completions are kept per prefix; takes effect at the next build
+    void setSuggestionCount(int k) {
+        topK = max(1, k);
+    }
+
+    int suggestionCount() const {
+        return topK;
+    }
+
+    // Add word to the dictionary, with how common it is. Words are collected
+    // and laid out into the compact trie by build(); queries only see words
+    // added before the last build, which keeps them read-only and safe to
+    // run from several threads at once.
+    void addWord(const string& text, uint32_t weight = 1) {
+        string word;
+        for (char c : text) {
+            if (islower(c)) word += c;
+        }
+        staged.push_back({word, weight});
+    }
+
+    // Merge the added words into the trie
+    void build() {
+        if (staged.empty()) return;
+        vector<pair<string, uint32_t>> words;
+        words.reserve(wordCount + staged.size());
+        for (uint32_t id = 0; id < wordCount; ++id) words.push_back({wordAt(id), wordWeight[id]});
+        words.insert(words.end(), staged.begin(), staged.end());
+        staged.clear();
+        // A word added twice keeps its highest weight
+        sort(words.begin(), words.end(), [](const pair<string, uint32_t>& a, const pair<string, uint32_t>& b) {
+            return a.first != b.first ? a.first < b.first : a.second > b.second;
+        });
+        words.erase(unique(words.begin(), words.end(), [](const pair<string, uint32_t>& a, const pair<string, uint32_t>& b) {
+            return a.first == b.first;
+        }), words.end());
+        buildFrom(words);
+    }
+
+    // Memory held by the trie, in bytes
+    size_t memoryUsage() const {
+        if (mapping) return mappingSize;
+        return (ownedNodes.capacity() + ownedReverseNodes.capacity()) * sizeof(TrieNode) + ownedWordText.capacity()
+             + (ownedTopOffset.capacity() + ownedTopList.capacity() + ownedWordOffset.capacity()
+                + ownedWordWeight.capacity()) * sizeof(uint32_t);
+    }
+
+    // Write the dictionary as an image that mapImage() can use directly. The size and
+    // modification time of the source word list are stored to detect staleness.
+    bool saveImage(const string& path, uint64_t sourceSize, int64_t sourceModified) {
+        build();
+        DictionaryImageHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, DICTIONARY_IMAGE_MAGIC, sizeof(header.magic));
+        header.nodeSize = sizeof(TrieNode);
+        header.topK = topK;
+        header.nodeCount = nodeCount;
+        header.reverseCount = reverseCount;
+        header.wordCount = wordCount;
+        header.topCount = topCount;
+        header.textBytes = wordOffset[wordCount];
+        header.sourceSize = sourceSize;
+        header.sourceModified = sourceModified;
+
+        string temp = path + ".tmp";
+        ofstream file(temp, ios::binary | ios::trunc);
+        file.write((const char*)&header, sizeof(header));
+        file.write((const char*)nodes, nodeCount * sizeof(TrieNode));
+        file.write((const char*)reverseNodes, reverseCount * sizeof(TrieNode));
+        file.write((const char*)topOffset, (nodeCount + 1) * sizeof(uint32_t));
+        file.write((const char*)topList, topCount * sizeof(uint32_t));
+        file.write((const char*)wordOffset, (wordCount + 1) * sizeof(uint32_t));
+        file.write((const char*)wordWeight, wordCount * sizeof(uint32_t));
+        file.write(wordText, header.textBytes);
+        file.close();
+        if (!file) return false;
+        return rename(temp.c_str(), path.c_str()) == 0;
+    }
+
+    // Use a prebuilt image in place. The file is mapped read-only and shared,
+    // so nothing is parsed or allocated and every editor process reuses the
+    // same pages. Fails if the image is missing, damaged, keeps fewer ranked
+    // completions than configured, or was built from a word list with a
+    // different size or modification time.
+    bool mapImage(const string& path, uint64_t sourceSize, int64_t sourceModified) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(DictionaryImageHeader)) {
+            data = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (data == MAP_FAILED) return false;
+
+        const DictionaryImageHeader* header = (const DictionaryImageHeader*)data;
+        uint64_t expected = sizeof(DictionaryImageHeader)
+                          + ((uint64_t)header->nodeCount + header->reverseCount) * sizeof(TrieNode)
+                          + ((uint64_t)header->nodeCount + 1 + header->topCount + header->wordCount + 1
+                             + header->wordCount) * sizeof(uint32_t)
+                          + header->textBytes;
+        bool valid = memcmp(header->magic, DICTIONARY_IMAGE_MAGIC, sizeof(header->magic)) == 0
+                  && header->nodeSize == sizeof(TrieNode)
+                  && header->nodeCount > 0
+                  && header->reverseCount > 0
+                  && header->topK >= (uint32_t)topK
+                  && expected == (uint64_t)info.st_size
+                  && header->sourceSize == sourceSize
+                  && header->sourceModified == sourceModified;
+        if (!valid) {
+            munmap(data, info.st_size);
+            return false;
+        }
+        unmap();
+        mapping = data;
+        mappingSize = info.st_size;
+        const char* section = (const char*)data + sizeof(DictionaryImageHeader);
+        nodes = (const TrieNode*)section;
+        nodeCount = header->nodeCount;
+        section += nodeCount * sizeof(TrieNode);
+        reverseNodes = (const TrieNode*)section;
+        reverseCount = header->reverseCount;
+        section += reverseCount * sizeof(TrieNode);
+        topOffset = (const uint32_t*)section;
+        section += (nodeCount + 1) * sizeof(uint32_t);
+        topList = (const uint32_t*)section;
+        topCount = header->topCount;
+        section += topCount * sizeof(uint32_t);
+        wordCount = header->wordCount;
+        wordOffset = (const uint32_t*)section;
+        section += (wordCount + 1) * sizeof(uint32_t);
+        wordWeight = (const uint32_t*)section;
+        section += wordCount * sizeof(uint32_t);
+        wordText = section;
+
+        ownedNodes = ownedReverseNodes = vector<TrieNode>();
+        ownedTopOffset = ownedTopList = ownedWordOffset = ownedWordWeight = vector<uint32_t>();
+        ownedWordText = string();
+        staged.clear();
+        return true;
+    }
+
+    // Check if word exists
+    bool exists(const string& text) const {
+        int node = find(text);
+        return node >= 0 && nodes[node].endOfWord();
+    }
+
+    // How common a word is, 0 if it is not in the dictionary
+    uint32_t weightOf(const string& word) const {
+        int node = find(word);
+        if (node < 0 || !nodes[node].endOfWord()) return 0;
+        return wordWeight[topList[topOffset[node]]];
+    }
+
+    // Number of words in the trie
+    size_t size() const {
+        return wordCount;
+    }
+
+    // Stage every word of other, with its weight, for the next build()
+    void addWordsOf(const Dictionary& other) {
+        staged.reserve(staged.size() + other.wordCount);
+        for (uint32_t id = 0; id < other.wordCount; ++id) staged.push_back({other.wordAt(id), other.wordWeight[id]});
+    }
+
+    // Dictionary words within maxDistance edits of word (insertions,
+    // deletions, substitutions and swapped neighbours), nearest first and
+    // most common first among equally near ones; words in usage count as
+    // more common. At most k are returned.
+    vector<string> corrections(const string& word, int maxDistance = 2, int k = -1, const WordCounts& usage = WordCounts()) const {
+        if (k < 0) k = topK;
+        vector<string> results;
+        if (word.empty() || any_of(word.begin(), word.end(), [](char c) { return c < 'a' || c > 'z'; })) {
+            return results;
+        }
+        // Nearer words always rank first, so widen the search one edit at a
+        // time and stop once there are enough. Walking the whole trie within
+        // d edits fans out near the root, so the word is cut in half: a match
+        // spends at most d / 2 edits on the first half, or fewer than
+        // d - d / 2 on the second. The first case walks the trie with that
+        // budget for the first half, the second walks the trie of reversed
+        // words with the reversed word.
+        CorrectionSearch search;
+        string backwards(word.rbegin(), word.rend());
+        int first = (word.size() + 1) / 2, second = word.size() - first;
+        for (int distance = 1; distance <= maxDistance; ++distance) {
+            search.found.clear();
+            searchCorrections(search, nodes, word, distance, first, distance / 2);
+            searchCorrections(search, reverseNodes, backwards, distance, second, distance - distance / 2 - 1);
+            sort(search.found.begin(), search.found.end());
+            search.found.erase(unique(search.found.begin(), search.found.end()), search.found.end());
+            if ((int)search.found.size() >= k) break;
         }
+
+        vector<tuple<int, uint64_t, string>> ranked;
+        for (auto& match : search.found) {
+            auto used = usage.find(match.second);
+            uint64_t uses = used == usage.end() ? 0 : used->second;
+            ranked.emplace_back(match.first, (uint64_t)weightOf(match.second) * (1 + uses), match.second);
+        }
+        size_t keep = min(ranked.size(), (size_t)k);
+        partial_sort(ranked.begin(), ranked.begin() + keep, ranked.end(),
+                     [](const tuple<int, uint64_t, string>& a, const tuple<int, uint64_t, string>& b) {
+            if (get<0>(a) != get<0>(b)) return get<0>(a) < get<0>(b);
+            if (get<1>(a) != get<1>(b)) return get<1>(a) > get<1>(b);
+            return get<2>(a) < get<2>(b);
+        });
+        for (size_t i = 0; i < keep; ++i) results.push_back(get<2>(ranked[i]));
+        return results;
+    }
+
+    // Longest prefix of text that leads somewhere in the trie
+    string longestPrefix(const string& text) const {
+        int current = 0;
+        size_t length = 0;
+        while (length < text.size() && text[length] >= 'a' && text[length] <= 'z') {
+            int next = child(current, text[length]);
+            if (next < 0) break;
+            current = next;
+            length++;
+        }
+        return text.substr(0, length);
     }
 
-    // Generate suggestions based on prefix
-    vector<string> suggest(const string& query) {
-        Node* current = base;
+    // Generate up to k suggestions for a prefix, most common first. Each node
+    // keeps its ranked list, so this costs O(|prefix| + k) however many words
+    // share the prefix; words the user writes often are moved up.
+    vector<string> suggest(const string& query, int k = -1, const WordCounts& usage = WordCounts()) const {
+        if (k < 0 || k > topK) k = topK;
         vector<string> results;
-        for (char c : query) {
-            int idx = c - 'a';
-            if (idx < 0 || idx >= 26 || current->links[idx] == nullptr)
-                return results;
-            current = current->links[idx];
-        }
-        string tempPrefix = query;
-        fetchSuggestions(current, tempPrefix, results);
+        int node = find(query);
+        if (node < 0) return results;
+        const uint32_t* first = topList + topOffset[node] + nodes[node].endOfWord();
+        const uint32_t* last = topList + topOffset[node + 1];
+        if (usage.empty()) {
+            for (const uint32_t* id = first; id != last && (int)results.size() < k; ++id) {
+                results.push_back(wordAt(*id));
+            }
+            return results;
+        }
+
+        // Score = weight * (1 + times the user wrote it), over the node's list
+        // plus a bounded number of the user's own words with this prefix
+        const int USER_WORDS_SCANNED = 64;
+        vector<pair<uint64_t, string>> scored;
+        for (const uint32_t* id = first; id != last; ++id) {
+            string word = wordAt(*id);
+            auto used = usage.find(word);
+            uint64_t uses = used == usage.end() ? 0 : used->second;
+            scored.push_back({(uint64_t)wordWeight[*id] * (1 + uses), word});
+        }
+        int scanned = 0;
+        for (auto it = usage.lower_bound(query);
+             it != usage.end() && it->first.compare(0, query.size(), query) == 0 && scanned < USER_WORDS_SCANNED;
+             ++it, ++scanned) {
+            scored.push_back({(uint64_t)weightOf(it->first) * (1 + it->second), it->first});
+        }
+        stable_sort(scored.begin(), scored.end(), [](const pair<uint64_t, string>& a, const pair<uint64_t, string>& b) {
+            return a.first > b.first;
+        });
+        for (auto& entry : scored) {
+            if ((int)results.size() == k) break;
+            if (std::find(results.begin(), results.end(), entry.second) == results.end()) results.push_back(entry.second);
+        }
         return results;
     }
 };
 
-// Load words from file into Dictionary
-void initializeDictionary(Dictionary& dict, const string& filename) {
+// Image file that goes with a word list: dictionary.txt -> dictionary.img
+string dictionaryImagePath(const string& filename) {
+    size_t dot = filename.find_last_of('.');
+    size_t slash = filename.find_last_of('/');
+    if (dot == string::npos || (slash != string::npos && dot < slash)) return filename + ".img";
+    return filename.substr(0, dot) + ".img";
+}
+
+// Size and modification time of a file, used to tell whether an image is stale
+bool fileStamp(const string& filename, uint64_t& size, int64_t& modified) {
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0) return false;
+    size = info.st_size;
+    modified = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    return true;
+}
+
+// Add every line of a word list. A line may end with a frequency after
+// whitespace ("apple 1520"); lines without one count as weight 1, and
+// frequencies too large for a weight are clamped to UINT32_MAX.
+void loadWordList(Dictionary& dict, const string& filename) {
     ifstream file(filename);
     string input;
     while (getline(file, input)) {
-        dict.addWord(input);
+        size_t split = input.find_last_of(" \t");
+        if (split != string::npos && split + 1 < input.size() &&
+            all_of(input.begin() + split + 1, input.end(), ::isdigit)) {
+            errno = 0;
+            unsigned long long weight = strtoull(input.c_str() + split + 1, nullptr, 10);
+            if (errno == ERANGE || weight > UINT32_MAX) weight = UINT32_MAX;
+            dict.addWord(input.substr(0, split), (uint32_t)weight);
+        } else {
+            dict.addWord(input);
+        }
     }
     file.close();
+    dict.build();
+}
+
+// Compile a word list into an image for initializeDictionary() to map
+bool buildDictionaryImage(Dictionary& dict, const string& filename, const string& imagePath) {
+    uint64_t size;
+    int64_t modified;
+    if (!fileStamp(filename, size, modified)) return false;
+    loadWordList(dict, filename);
+    return dict.saveImage(imagePath, size, modified);
 }
 
-// Spellcheck and offer suggestions
-void verifyWord(Dictionary& dict, const string& originalWord, const string& outputPath) {
-    ofstream log(outputPath, ios::app);
+// Load words from file into Dictionary. A prebuilt image that is up to date
+// with the file is mapped instead; otherwise the word list is parsed.
+void initializeDictionary(Dictionary& dict, const string& filename) {
+    uint64_t size = 0;
+    int64_t modified = 0;
+    if (fileStamp(filename, size, modified) && dict.mapImage(dictionaryImagePath(filename), size, modified)) {
+        return;
+    }
+    loadWordList(dict, filename);
+}
 
-    string cleaned = originalWord;
+// Normalise a word the way the spellchecker compares it: punctuation dropped, lowercase
+string cleanWord(const string& word) {
+    string cleaned = word;
     cleaned.erase(remove_if(cleaned.begin(), cleaned.end(), ::ispunct), cleaned.end());
     transform(cleaned.begin(), cleaned.end(), cleaned.begin(), ::tolower);
+    return cleaned;
+}
 
-    if (!dict.exists(cleaned)) {
-        log << cleaned << " -> Suggestions:\n";
-        vector<string> options = dict.suggest(cleaned.substr(0, 2));
-        for (int i = 0; i < options.size(); ++i) {
-            log << options[i] << " ";
+// Dictionary Snapshots
+
+// Edits (insertions, deletions, substitutions and swapped neighbours) that turn a into b
+int editDistance(const string& a, const string& b) {
+    vector<vector<int>> d(a.size() + 1, vector<int>(b.size() + 1));
+    for (size_t i = 0; i <= a.size(); ++i) d[i][0] = i;
+    for (size_t j = 0; j <= b.size(); ++j) d[0][j] = j;
+    for (size_t i = 1; i <= a.size(); ++i) {
+        for (size_t j = 1; j <= b.size(); ++j) {
+            d[i][j] = min({d[i - 1][j] + 1, d[i][j - 1] + 1, d[i - 1][j - 1] + (a[i - 1] != b[j - 1])});
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1]) d[i][j] = min(d[i][j], d[i - 2][j - 2] + 1);
         }
-        log << "\n\n";
     }
-
-    log.close();
+    return d[a.size()][b.size()];
 }
 
-// Global dictionary object
-Dictionary wordBase;
+// One published state of the dictionary: a built trie, and beside it the
+// words the user added since, in a small trie of their own until they are
+// merged in. Never changed once published, so any number of threads may
+// query it at once.
+class DictionaryVersion {
+public:
+    shared_ptr<const Dictionary> base;    // Shared with later versions until the next merge or reload
+    shared_ptr<const Dictionary> added;   // The user's words that base lacks
+    vector<string> addedWords;            // The same words, for the next merge
+    uint64_t number = 0;                  // Higher for every later version
 
-// Text Editor Settings
+    DictionaryVersion(shared_ptr<const Dictionary> base, const vector<string>& userWords) : base(base) {
+        Dictionary* words = new Dictionary;
+        words->setSuggestionCount(base->suggestionCount());
+        for (const string& word : userWords) {
+            if (base->exists(word) || words->exists(word)) continue;
+            words->addWord(word);
+            addedWords.push_back(word);
+        }
+        words->build();
+        added.reset(words);
+    }
 
-long long int totalWords = 0;
-const vector<int> ThemeColors = {7, 9, 10, 12, 13, 14}; // Theme: Default, Blue, Green, Red, Magenta, Yellow
-auto currentColor = ThemeColors.begin();
-class text_ed {
+    bool exists(const string& word) const {
+        return base->exists(word) || added->exists(word);
+    }
+
+    uint32_t weightOf(const string& word) const {
+        return max(base->weightOf(word), added->weightOf(word));
+    }
+
+    string longestPrefix(const string& text) const {
+        string inBase = base->longestPrefix(text), inAdded = added->longestPrefix(text);
+        return inAdded.size() > inBase.size() ? inAdded : inBase;
+    }
+
+    // As Dictionary::suggest(), over both tries
+    vector<string> suggest(const string& query, int k = -1, const WordCounts& usage = WordCounts()) const {
+        vector<string> found = base->suggest(query, k, usage);
+        if (added->size() == 0) return found;
+        for (string& word : added->suggest(query, k, usage)) found.push_back(move(word));
+        auto score = [&](const string& word) {
+            auto used = usage.find(word);
+            return (uint64_t)weightOf(word) * (1 + (used == usage.end() ? 0 : used->second));
+        };
+        stable_sort(found.begin(), found.end(), [&](const string& a, const string& b) {
+            return score(a) > score(b);
+        });
+        found.resize(min(found.size(), (size_t)(k < 0 || k > base->suggestionCount() ? base->suggestionCount() : k)));
+        return found;
+    }
+
+    // As Dictionary::corrections(), over both tries
+    vector<string> corrections(const string& word, int maxDistance = 2, int k = -1, const WordCounts& usage = WordCounts()) const {
+        vector<string> found = base->corrections(word, maxDistance, k, usage);
+        vector<string> more = added->corrections(word, maxDistance, k, usage);
+        if (more.empty()) return found;
+        found.insert(found.end(), more.begin(), more.end());
+        vector<tuple<int, uint64_t, string>> ranked;
+        for (string& match : found) {
+            auto used = usage.find(match);
+            uint64_t uses = used == usage.end() ? 0 : used->second;
+            ranked.emplace_back(editDistance(word, match), ~((uint64_t)weightOf(match) * (1 + uses)), move(match));
+        }
+        sort(ranked.begin(), ranked.end());
+        found.clear();
+        for (auto& match : ranked) {
+            if ((int)found.size() == (k < 0 ? base->suggestionCount() : k)) break;
+            found.push_back(get<2>(match));
+        }
+        return found;
+    }
+};
+
+// Hands out DictionaryVersions to readers that never lock or wait, while
+// writers replace them: adding a user word, merging the added words into
+// the trie, or reloading the word list. A reader pins the current version
+// with read(); a writer builds a new version, swaps the pointer and frees
+// the old one once no reader can still be using it. For that each reading
+// thread has a slot holding the epoch it started reading in (0 when it is
+// not reading), and a version replaced in epoch E is freed once no slot
+// holds E or earlier. The next publish() frees what it can, and so does a
+// reader finishing while replaced versions wait, as long as no writer holds
+// the store then. Slots and epochs are shared by every store.
+class DictionaryStore {
 private:
-    stack<char> left_st;     // Characters before the cursor
-    stack<char> right_st;    // Characters after the cursor
-    vector<stack<char>> textLines;  // One stack per line of text
-    int activeLine = 0;         // Current line being edited
-    int cursorPosX = 0, cursorPosY = 0; // Console cursor location
-
-    vector<vector<stack<char>>> undoHistory; // Stores snapshots for undo
-    vector<vector<stack<char>>> redoHistory; // Stores snapshots for redo
-
-    unordered_map<string, string> auto_comp_word = {
-        {"add", "address"}, {"adm", "administration"}, {"agr", "agree"}, {"ans", "answer"},
-        {"app", "application"}, {"arg", "argue"}, {"assi", "assignment"}, {"aut", "automatic"},
-        {"beg", "beginning"}, {"bel", "believe"}, {"ben", "benefit"}, {"bet", "between"},
-        {"bro", "brother"}, {"bu", "business"}, {"cal", "calendar"}, {"cap", "capacity"},
-        {"cha", "character"}, {"cho", "choice"}, {"cla", "class"}, {"cli", "client"},
-        {"com", "communication"}, {"con", "contract"}, {"cor", "correction"}, {"cou", "country"},
-        {"cre", "credit"}, {"dec", "decision"}, {"del", "delivery"}, {"dep", "department"},
-        {"dev", "development"}, {"dir", "direction"}, {"dis", "discussion"}, {"doc", "document"},
-        {"dra", "draft"}, {"edu", "education"}, {"eff", "effect"}, {"emp", "employee"},
-        {"enc", "encourage"}, {"equ", "equipment"}, {"est", "establish"}, {"eve", "event"},
-        {"exp", "experience"}, {"fin", "financial"}, {"fol", "following"}, {"for", "formation"},
-        {"fun", "function"}, {"gen", "general"}, {"gro", "group"}, {"gui", "guidance"},
-        {"hea", "health"}, {"his", "history"}, {"ide", "idea"}, {"imp", "important"},
-        {"ind", "individual"}, {"inf", "information"}, {"int", "interest"}, {"inv", "investment"},
-        {"jud", "judgment"}, {"jus", "justice"}, {"lan", "language"}, {"leg", "legal"},
-        {"lev", "level"}, {"lib", "library"}, {"loc", "location"}, {"man", "management"},
-        {"mat", "material"}, {"mea", "measure"}, {"mem", "member"}, {"met", "method"},
-        {"mil", "military"}, {"nat", "national"}, {"nee", "necessary"}, {"net", "network"},
-        {"not", "notice"}, {"obj", "object"}, {"off", "office"}, {"ope", "operation"},
-        {"org", "organization"}, {"par", "parent"}, {"pat", "pattern"}, {"per", "performance"},
-        {"pla", "platform"}, {"pol", "policy"}, {"pos", "position"}, {"pre", "presentation"},
-        {"pro", "program"}, {"pub", "public"}, {"qui", "quickly"}, {"rea", "reason"},
-        {"rec", "recommend"}, {"rel", "relationship"}, {"rep", "report"}, {"res", "response"},
-        {"rev", "review"}, {"sec", "section"}, {"ser", "service"}, {"sig", "significant"},
-        {"sim", "similar"}, {"soc", "social"}, {"sta", "standard"}, {"str", "structure"},
-        {"sys", "system"}, {"the", "theory"}, {"typ", "typical"}, {"uni", "university"},
-        {"val", "value"}, {"vie", "view"}, {"wor", "worker"}
+    static const int READER_SLOTS = 256;
+
+    struct alignas(64) ReaderSlot {
+        atomic<uint64_t> epoch{0};
+        atomic<bool> taken{false};
+    };
+
+    // A thread's claim on a slot, given back when the thread ends
+    struct SlotLease {
+        ReaderSlot* slot = nullptr;
+        int depth = 0;    // Reads in progress on this thread; only the outermost one pins
+        ~SlotLease() {
+            if (slot) slot->taken.store(false);
+        }
     };
 
-    // Utility to position the console cursor
-    void moveConsoleCursor(int x, int y) {
-        COORD location;
-        location.X = x;
-        location.Y = y;
-        SetConsoleCursorPosition(GetStdHandle(STD_OUTPUT_HANDLE), location);
+    static ReaderSlot slots[READER_SLOTS];
+    static atomic<uint64_t> epoch;
+
+    atomic<const DictionaryVersion*> current{nullptr};
+    atomic<uint64_t> published{0};
+    mutable mutex writer;   // Writers take turns; readers only try it to free retired versions
+    mutable vector<pair<uint64_t, const DictionaryVersion*>> retired;  // Replaced versions and the epoch they were replaced in
+    mutable atomic<bool> anyRetired{false};                            // retired is not empty
+    string wordListPath, userWordsPath;
+    int topK = DEFAULT_SUGGESTIONS;
+
+    mutex rebuildLock;
+    thread rebuilder;      // Merges or reloads off the calling thread
+    bool rebuilding = false;
+    bool mergeWanted = false, reloadWanted = false;
+
+    static SlotLease& lease() {
+        static thread_local SlotLease threadLease;
+        while (!threadLease.slot) {
+            for (ReaderSlot& slot : slots) {
+                bool free = false;
+                if (slot.taken.compare_exchange_strong(free, true)) {
+                    threadLease.slot = &slot;
+                    break;
+                }
+            }
+            if (!threadLease.slot) this_thread::yield();   // More reading threads than slots
+        }
+        return threadLease;
     }
 
-    // (Remaining editor methods would be added here)
-};
-// Helper function to display the current text
-void displayText() {
-    system("cls");
-    for (int i = 0; i <= activeLine; i++) {
-        stack<char> temp = textLines[i];
-        stack<char> reversedLeft;
-        while (!temp.empty()) {
-            reversedLeft.push(temp.top());
-            temp.pop();
+    static void pin() {
+        SlotLease& held = lease();
+        if (held.depth++ == 0) held.slot->epoch.store(epoch.load());
+    }
+
+    static void unpin() {
+        SlotLease& held = lease();
+        if (--held.depth == 0) held.slot->epoch.store(0);
+    }
+
+    // Make next the current version. Called with writer held.
+    void publish(DictionaryVersion* next) {
+        next->number = published.load() + 1;
+        const DictionaryVersion* old = current.exchange(next);
+        published.store(next->number);
+        uint64_t replacedIn = epoch.fetch_add(1);   // Readers that start from now on get a later epoch
+        if (old) retired.push_back({replacedIn, old});
+        reclaim();
+    }
+
+    // Free the retired versions no reader can still be using. Called with
+    // writer held.
+    void reclaim() const {
+        uint64_t oldest = UINT64_MAX;
+        for (ReaderSlot& slot : slots) {
+            uint64_t reading = slot.epoch.load();
+            if (reading) oldest = min(oldest, reading);
         }
-        while (!reversedLeft.empty()) {
-            cout << reversedLeft.top();
-            reversedLeft.pop();
+        retired.erase(remove_if(retired.begin(), retired.end(), [oldest](const pair<uint64_t, const DictionaryVersion*>& version) {
+            if (version.first >= oldest) return false;
+            delete version.second;
+            return true;
+        }), retired.end());
+        anyRetired.store(!retired.empty());
+    }
+
+    // After a read: free what the finished readers left behind, unless a
+    // writer is busy, in which case its publish() will
+    void reclaimAfterRead() const {
+        if (!anyRetired.load(memory_order_relaxed)) return;
+        unique_lock<mutex> guard(writer, try_to_lock);
+        if (guard.owns_lock()) reclaim();
+    }
+
+    // The user's words, one per line
+    vector<string> readUserWords() const {
+        vector<string> words;
+        ifstream file(userWordsPath);
+        string word;
+        while (getline(file, word)) {
+            if (!word.empty()) words.push_back(word);
         }
+        return words;
+    }
 
-        // Display suggestion if we’re on the active line
-        if (i == activeLine) {
-            string str = "";
-            stack<char> tempStack = left_st;
-            while (!tempStack.empty() && tempStack.top() != ' ') {
-                str += tempStack.top();
-                tempStack.pop();
+    // Merge the added words into the trie and/or reload the word list until
+    // no more is asked for. Readers keep the old version meanwhile.
+    void rebuild() {
+        while (true) {
+            bool reload;
+            {
+                lock_guard<mutex> guard(rebuildLock);
+                if (!mergeWanted && !reloadWanted) {
+                    rebuilding = false;
+                    return;
+                }
+                reload = reloadWanted;
+                mergeWanted = reloadWanted = false;
             }
-            reverse(str.begin(), str.end());
-
-            if (auto_comp_word.find(str) != auto_comp_word.end()) {
-                SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), SUGGESTION_COLOR);
-                cout << " *";  // Suggestion indicator
-                cout << " " << auto_comp_word[str];  // Suggested word
-                SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), DEFAULT_COLOR);  // Reset to normal
+            shared_ptr<Dictionary> next = make_shared<Dictionary>();
+            next->setSuggestionCount(topK);
+            if (reload) {
+                initializeDictionary(*next, wordListPath);
+            } else {
+                Reader now = read();
+                next->addWordsOf(*now->base);
+                for (const string& word : now->addedWords) next->addWord(word);
+                next->build();
             }
-
-            cout << "_";  // Cursor position
-            temp = right_st;
-            while (!temp.empty()) {
-                cout << temp.top();
-                temp.pop();
+            size_t added;
+            {
+                lock_guard<mutex> guard(writer);
+                // Words added while this was building stay beside the new trie
+                DictionaryVersion* version = new DictionaryVersion(next, reload ? readUserWords() : current.load()->addedWords);
+                added = version->addedWords.size();
+                publish(version);
+            }
+            if (added >= USER_WORDS_MERGE) {
+                lock_guard<mutex> guard(rebuildLock);
+                mergeWanted = true;
             }
         }
-        cout << endl;
     }
-}
-// Function to check if the state has changed
-bool isStateChanged() {
-    if (undoStack.empty()) return true; // If the undo stack is empty, consider it a change
 
-    const auto& lastState = undoStack.back();
-    if (lastState.size() != textLines.size()) return true; // If the number of lines is different
+    void requestRebuild(bool reload) {
+        lock_guard<mutex> guard(rebuildLock);
+        (reload ? reloadWanted : mergeWanted) = true;
+        if (rebuilding) return;   // The running rebuild picks this up before it finishes
+        if (rebuilder.joinable()) rebuilder.join();
+        rebuilding = true;
+        rebuilder = thread(&DictionaryStore::rebuild, this);
+    }
+
+public:
+    // The version that was current when it was made, kept alive until the
+    // Reader goes. Readers may nest and may be held by any thread.
+    class Reader {
+    private:
+        const DictionaryStore& store;
+        const DictionaryVersion* version;
+
+    public:
+        explicit Reader(const DictionaryStore& store) : store(store) {
+            pin();
+            version = store.current.load();
+        }
+
+        ~Reader() {
+            unpin();
+            store.reclaimAfterRead();
+        }
+
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        const DictionaryVersion& operator*() const { return *version; }
+        const DictionaryVersion* operator->() const { return version; }
+    };
+
+    DictionaryStore() {
+        publish(new DictionaryVersion(make_shared<Dictionary>(), {}));
+    }
 
-    for (size_t i = 0; i < textLines.size(); ++i) {
-        if (textLines[i].size() != lastState[i].size()) return true; // Different line sizes
+    DictionaryStore(const DictionaryStore&) = delete;
+    DictionaryStore& operator=(const DictionaryStore&) = delete;
 
-        stack<char> temp1 = textLines[i];
-        stack<char> temp2 = lastState[i];
-        while (!temp1.empty() && !temp2.empty()) {
-            if (temp1.top() != temp2.top()) return true; // Characters differ
-            temp1.pop();
-            temp2.pop();
+    // Nothing may be reading by now
+    ~DictionaryStore() {
+        {
+            lock_guard<mutex> guard(rebuildLock);
+            mergeWanted = reloadWanted = false;
         }
+        if (rebuilder.joinable()) rebuilder.join();
+        for (auto& version : retired) delete version.second;
+        delete current.load();
+    }
 
-        // If one stack is empty and the other is not, consider it a change
-        if (!temp1.empty() || !temp2.empty()) return true;
+    Reader read() const {
+        return Reader(*this);
     }
 
-    return false; // No changes detected
-}
-// Helper function to check if the character should be capitalized
-bool shouldCapitalize() {
-    if (left_st.empty()) return true;  // Capitalize at the start of a line
+    // Number of the current version, which goes up with every change
+    uint64_t version() const {
+        return published.load();
+    }
 
-    // Check if the last character before the cursor is a period, space, or newline
-    char lastChar = left_st.top();
-    if (lastChar == '.' || lastChar == '\n' || isspace(lastChar)) return true;
+    // Set how many ranked completions are kept per prefix; takes effect at the next load
+    void setSuggestionCount(int k) {
+        topK = max(1, k);
+    }
 
-    return false;
-}
-public:
-    text_ed() {
-        // Initially start with one empty line
-        textLines.push_back(stack<char>());
-        undoStack.push_back(textLines); // Initialize undo stack with the initial state
-        
-        SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), *Colour_Itr);  // Set initial colour attribute to default
-        
-        FILE *fp;
-        fp = fopen("word_count.txt","w");   
-        if(!fp) 
+    int suggestionCount() const {
+        return topK;
+    }
+
+    // Load the word list (see initializeDictionary()) and the user's own
+    // words, which addWord() appends to userWords
+    void load(const string& wordList, const string& userWords) {
+        wordListPath = wordList;
+        userWordsPath = userWords;
+        shared_ptr<Dictionary> base = make_shared<Dictionary>();
+        base->setSuggestionCount(topK);
+        initializeDictionary(*base, wordList);
+        size_t added;
         {
-            cout << "File did not open" << endl;
-            exit(1);
+            lock_guard<mutex> guard(writer);
+            DictionaryVersion* version = new DictionaryVersion(base, readUserWords());
+            added = version->addedWords.size();
+            publish(version);
         }
-        fprintf(fp, "Current Word Count: %lld", Word_Count);  // Initialize the word count 0 right when text_ed object is created.
-        fclose(fp);    
+        if (added >= USER_WORDS_MERGE) requestRebuild(false);
+    }
+
+    // Use dict as it is, with no user words
+    void use(shared_ptr<const Dictionary> dict) {
+        lock_guard<mutex> guard(writer);
+        publish(new DictionaryVersion(dict, {}));
     }
-// Insert a character at the current cursor position with auto-capitalization
-void insert_capital(char ch) {
-    // Capitalize if it's the first character being inserted or follows a newline or period, only works "." and ". " or multiple ".... "
-    bool caps = false; // caps stores the state, whether to capitalize or not
-    // Check if the left stack is empty which implies that it is the first character
-    if (left_st.empty()) {
-        caps = true;  // initialize state to be capitalized
-    } else {
-        // Create a temporary stack to check the last characters as we cannot access the elements before the top.
-        stack<char> tempStack = left_st;
-        char lastChar = tempStack.top();
-        tempStack.pop();
 
-        // Check if the last character is a newline or a full stop
-        if (lastChar == '\n' || lastChar == '.' || lastChar == '?' || lastChar == '!') {
-            caps = true; // Capitalize the next character
-        } else if (lastChar == ' ') {
-            // Check the second last character (if it exists)
-            if (!tempStack.empty() && (tempStack.top() == '.' || tempStack.top() == '!' || tempStack.top() == '?')) {
-                caps = true; // Capitalize after a space following a period
+    // Add a word of the user's (cleaned as the spellchecker cleans words) and
+    // remember it in the user word file. Readers see it from their next
+    // read(). False if it is not a word or is already known.
+    bool addWord(const string& text) {
+        string word = cleanWord(text);
+        if (word.empty() || any_of(word.begin(), word.end(), [](char c) { return c < 'a' || c > 'z'; })) return false;
+        size_t added;
+        {
+            lock_guard<mutex> guard(writer);
+            const DictionaryVersion* now = current.load();
+            if (now->exists(word)) return false;
+            if (!userWordsPath.empty()) {
+                ofstream file(userWordsPath, ios::app);
+                file << word << '\n';
             }
+            vector<string> words = now->addedWords;
+            words.push_back(word);
+            publish(new DictionaryVersion(now->base, words));
+            added = words.size();
         }
+        if (added >= USER_WORDS_MERGE) requestRebuild(false);
+        return true;
     }
-}
-// Insert the character (capitalize if needed)
-if (caps) {
-    left_st.push(toupper(ch));  // Capitalize the current character
-} else {
-    left_st.push(ch);  // Keep the character as is
-}
-
-textLines[currentLine] = left_st;
-redoStack.clear(); // Clear the redo stack when a new character is inserted
 
-if (isStateChanged()) {
-    undoStack.push_back(textLines); // Push only if the state has changed
-}
-// Move the cursor to the left
-void moveCursorLeft() {
-    if (!left_st.empty()) {
-        right_st.push(left_st.top());
-        left_st.pop();
-        textLines[currentLine] = left_st;  // Update the current line with the new left stack
+    // Reload the word list and user words in the background, as after an
+    // update to dictionary.txt
+    void reload() {
+        if (!wordListPath.empty()) requestRebuild(true);
     }
-}
+};
+
+DictionaryStore::ReaderSlot DictionaryStore::slots[DictionaryStore::READER_SLOTS];
+atomic<uint64_t> DictionaryStore::epoch{1};
 
-// Move the cursor to the right
-void moveCursorRight() {
-    if (!right_st.empty()) {
-        left_st.push(right_st.top());
-        right_st.pop();
-        textLines[currentLine] = left_st;  // Update the current line with the new left stack
+// Append the log entry for a misspelt word: the nearest words by edit
+// distance, or failing that, completions of the longest part of the word
+// the dictionary recognises
+void describeMisspelling(const DictionaryVersion& dict, const string& cleaned, string& out,
+                         const WordCounts& usage = WordCounts()) {
+    out += cleaned;
+    out += " -> Suggestions:\n";
+    vector<string> options = dict.corrections(cleaned, 2, -1, usage);
+    if (options.empty()) options = dict.suggest(dict.longestPrefix(cleaned), -1, usage);
+    for (size_t i = 0; i < options.size(); ++i) {
+        out += options[i];
+        out += ' ';
     }
+    out += "\n\n";
 }
-// Move the cursor up
-void moveCursorUp() {
-    if (currentLine > 0) {
-        textLines[currentLine] = left_st;    // Store current line state
-        currentLine--;                       // Move to the previous line
-        left_st = textLines[currentLine];    // Load the previous line's left_st
-        right_st = stack<char>();            // Clear the right_st (cursor at end of previous line)
-        cursorY = max(cursorY - 1, 0);       // Update cursor Y position
-        cursorX = left_st.size();            // Move the cursor to the end of the previous line
+
+// Spellcheck a word and write suggestions to log if it is misspelt; true if
+// it is spelt correctly, in which case it is counted in usage so the user's
+// own vocabulary ranks higher in suggestions
+bool verifyWord(const DictionaryVersion& dict, WordCounts& usage, const string& originalWord, ostream& log) {
+    string cleaned = cleanWord(originalWord);
+    if (!dict.exists(cleaned)) {
+        string entry;
+        describeMisspelling(dict, cleaned, entry, usage);
+        log << entry;
+        return false;
     }
+    usage[cleaned]++;
+    return true;
 }
 
-// Move the cursor down
-void moveCursorDown() {
-    if (currentLine < textLines.size() - 1) {
-        textLines[currentLine] = left_st;    // Store current line state
-        currentLine++;                       // Move to the next line
-        left_st = textLines[currentLine];    // Load the next line's left_st
-        right_st = stack<char>();            // Clear right_st
-        cursorY++;                           // Update cursor Y position
-        cursorX = left_st.size();            // Move the cursor to the end of the next line
-    }
-}
-// Backspace (delete character before the cursor)
-void backspace() {
-    if (!left_st.empty()) {
-        left_st.pop();
-        textLines[currentLine] = left_st;
-
-        if (isStateChanged()) {
-            undoStack.push_back(textLines); // Push only if the state has changed
-            // Limit the undo stack size
-            if (undoStack.size() > MAX_UNDO_SIZE) {
-                undoStack.erase(undoStack.begin()); // Remove the oldest state if limit exceeded
-            }
-        }
-
-        cursorX = max(cursorX - 1, 0);
-    } else if (currentLine > 0) {
-        cursorX = textLines[currentLine - 1].size();  // Move cursor to the end of the previous line
-        stack<char> previousLine = textLines[currentLine - 1];
-        while (!right_st.empty()) {
-            previousLine.push(right_st.top());
-            right_st.pop();
-        }
-        textLines[currentLine - 1] = previousLine;    // Merge the current line's right_st with the previous line
-        textLines.erase(textLines.begin() + currentLine); // Remove the current empty line
-        currentLine--;                               // Move to the previous line
-        left_st = textLines[currentLine];             // Load the left_st of the previous line
-    }
-}
-// Delete (delete character after the cursor)
-void deleteChar() {
-    if (!right_st.empty()) {
-        right_st.pop();
-        redoStack.clear(); // Clear the redo stack when delete is used
-    }
-}
-// Insert a newline, capitalize that character
-void insertCapitalNewLine() {
-    textLines[currentLine] = left_st;   // Store current line's state
-    redoStack.clear(); // Clear the redo stack when a new line is inserted
-    currentLine++;                    // Move to the next line
-    if (currentLine >= textLines.size()) {
-        textLines.push_back(stack<char>()); // Create a new line if necessary
-    }
-    left_st = stack<char>();        // Clear left stack for the new line
-    right_st = stack<char>();       // Clear right stack
-    cursorPosX = 0;                      // Reset cursor position
-    cursorPosY++;                        // Move cursor to the next line
-}
-// Undo the last operation
-void undo() {
-    if (undoStack.size() > 1) { // Check if there's an undo state available
-        redoStack.push_back(textLines);  // Store current state in redo before undoing
-        undoStack.pop_back();             // Remove the current state
-        textLines = undoStack.back();    // Restore the previous state
-        if (activeLine >= textLines.size()) activeLine = textLines.size() - 1;
-        left_st = textLines[activeLine];
-        right_st = stack<char>();        // Clear the right stack after undo
-    }
-}
-
-// Redo the last undone operation
-void redo() {
-    if (!redoStack.empty()) {
-        undoStack.push_back(textLines);   // Save current state to undo stack
-        textLines = redoStack.back();     // Restore the redo state
-        redoStack.pop_back();             // Remove the redo state
-        if (activeLine >= textLines.size()) activeLine = textLines.size() - 1;
-        left_st = textLines[activeLine];
-        right_st = stack<char>();         // Clear right stack after redo
-    }
-}
-// Save the content of the text editor to a file
-void save() {
-    ofstream file("myDoc.txt");
-    for (const auto& lineStack : textLines) {
-        // We need to output characters in the order they were added, so reverse the stack
-        std::stack<char> tempStack = lineStack;  // Make a copy of the current stack
-        std::stack<char> reverseStack;
-
-        // Reverse the stack to maintain original order of characters
-        while (!tempStack.empty()) {
-            reverseStack.push(tempStack.top());
-            tempStack.pop();
-        }
-
-        // Write characters from the reversed stack into the file
-        while (!reverseStack.empty()) {
-            file << reverseStack.top();
-            reverseStack.pop();
-        }
-        file << '\n';
+// Call visit(start, end, word) for every word of text, where word is the
+// cleaned form of text[start, end). Words are separated by whitespace;
+// tokens without a letter (numbers, stray symbols) are skipped.
+template <typename Visit>
+void forEachWord(const char* text, size_t len, Visit visit) {
+    // What each byte becomes in a cleaned word: SPACE ends the word, SKIP is
+    // punctuation, anything else is the lowercase character
+    const unsigned char SPACE = 0, SKIP = 1;
+    static const vector<unsigned char> cleaned = []() {
+        vector<unsigned char> table(256);
+        for (int c = 0; c < 256; ++c) {
+            table[c] = isspace(c) ? SPACE : ispunct(c) ? SKIP : tolower(c);
+        }
+        return table;
+    }();
+    string word;
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && cleaned[(unsigned char)text[i]] == SPACE) i++;
+        size_t start = i;
+        word.clear();
+        bool letters = false;
+        for (unsigned char c; i < len && (c = cleaned[(unsigned char)text[i]]) != SPACE; ++i) {
+            if (c == SKIP) continue;
+            letters |= c >= 'a' && c <= 'z';
+            word += c;
+        }
+        if (letters) visit(start, i, word);
     }
-    file.close();
 }
-long long int word_count() {
-    if (textLines[0].empty()) return 0;      // If there is no data yet, there are 0 words
-    long long int count = 0;        // Set initial count to 0
-    string all_lines = "";          // Create a string to store all the data so far
-
-    for (int i = textLines.size() - 1; i >= 0; i--) {      // Traverse through lines to get all data in one string
-        stack<char> flag = textLines[i];            
-        char curr;
-        if (!flag.empty()) curr = flag.top();
 
-        while (!flag.empty()) {
-            all_lines += curr;
-            curr = flag.top();
-            flag.pop();
+// Check every word of text, appending log entries for the misspelt ones to
+// out. Typos repeat across a corpus, so entries already worked out are
+// kept in seen.
+void checkText(const DictionaryVersion& dict, const char* text, size_t len, string& out,
+               unordered_map<string, string>& seen) {
+    const size_t MAX_REMEMBERED = 1 << 16;
+    forEachWord(text, len, [&](size_t, size_t, const string& word) {
+        if (dict.exists(word)) return;
+        auto known = seen.find(word);
+        if (known == seen.end()) {
+            if (seen.size() >= MAX_REMEMBERED) seen.clear();
+            string entry;
+            describeMisspelling(dict, word, entry);
+            known = seen.emplace(word, entry).first;
         }
-    }    
+        out += known->second;
+    });
+}
 
-    istringstream stream(all_lines);    // Define a stream from all_lines
-    string word;
-    while (stream >> word) {
-        count++;  // Take a word as input from the stream and keep count
-    }        
-    return count;                       
-}
-void display_word_count() {
-    Word_Count = word_count();  
-    FILE* fp;
-    fp = fopen("word_count.txt", "w");   
-    if (!fp) {
-        cout << "File did not open" << endl;
-        exit(1);
-    }
-    fprintf(fp, "Current Word Count: %lld", Word_Count);  // Store the live word count
-    fclose(fp);
-}
-void setTextColor(int color) {
-    SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), color);  // Set text colour to given colour
-}
-
-// Main function to handle real-time editing
-void runEditor() {
-    system("cls");
-    displayText();
-    setCursorPosition(cursorPosX, cursorPosY); // Updated cursor variable names
-
-    while (true) {
-        if (_kbhit()) {  // Checks if the keyboard gave a signal
-            int ch = _getch();
-
-            if (ch == 224) {  // Special keys (arrows, delete)
-                ch = _getch();  // Get the actual code
-
-                switch (ch) {
-                    case 75: // Left arrow key
-                        moveCursorLeft();
-                        cursorPosX = max(cursorPosX - 1, 0);
-                        break;
-                    case 77: // Right arrow key
-                        moveCursorRight();
-                        cursorPosX++;
-                        if (right_st.empty()) left_st.push(' '); // Updated stack names
-                        break;
-                    case 72: // Up arrow key
-                        moveCursorUp();
-                        break;
-                    case 80: // Down arrow key
-                        moveCursorDown();
-                        break;
-                    case 83: // Delete key (ASCII code 83)
-                        deleteChar();
-                        break;
-                }
-            }
-            else if (ch == 8) {  // Backspace
-                backspace();
-            }
-            else if (ch == 13) {  // Enter key
-                insertCapitalNewLine();
+// Spellcheck files (standard input if there are none) and write the log
+// entries for misspelt words to out, in input order. Input is read in large
+// blocks cut at whitespace, and the blocks are checked by a pool of threads
+// sharing the read-only dictionary. Finished blocks are written in order by
+// this thread, so output is the same however the work was scheduled.
+bool checkFiles(const DictionaryVersion& dict, const vector<string>& files, FILE* out) {
+    struct Block {
+        string text;
+        string result;
+        bool done = false;
+    };
+    mutex lock;
+    condition_variable workReady, blockDone;
+    deque<Block*> work;
+    bool finished = false;
+
+    unsigned threads = max(1u, thread::hardware_concurrency());
+    vector<thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&]() {
+            unordered_map<string, string> seen;
+            unique_lock<mutex> guard(lock);
+            while (true) {
+                workReady.wait(guard, [&]() { return finished || !work.empty(); });
+                if (work.empty()) return;
+                Block* block = work.front();
+                work.pop_front();
+                guard.unlock();
+                checkText(dict, block->text.data(), block->text.size(), block->result, seen);
+                guard.lock();
+                block->done = true;
+                blockDone.notify_all();
             }
-            else if (ch == 26) {  // Ctrl + Z (Undo)
-                undo();
+        });
+    }
+
+    // Blocks being checked, oldest first. Holding a few per thread keeps
+    // every thread busy while the oldest is waited on.
+    deque<unique_ptr<Block>> inFlight;
+    const size_t window = threads * 2;
+    auto writeFinished = [&](size_t keep) {
+        unique_lock<mutex> guard(lock);
+        while (inFlight.size() > keep) {
+            if (!inFlight.front()->done) {
+                blockDone.wait(guard);
+                continue;
             }
-            else if (ch == 25) {  // Ctrl + Y (Redo)
-                redo();
+            unique_ptr<Block> block = move(inFlight.front());
+            inFlight.pop_front();
+            guard.unlock();
+            fwrite(block->result.data(), 1, block->result.size(), out);
+            guard.lock();
+        }
+    };
+    auto submit = [&](string& text) {
+        writeFinished(window - 1);
+        unique_ptr<Block> block(new Block());
+        block->text.swap(text);
+        lock_guard<mutex> guard(lock);
+        work.push_back(block.get());
+        inFlight.push_back(move(block));
+        workReady.notify_one();
+    };
+
+    bool ok = true;
+    vector<string> inputs = files.empty() ? vector<string>{"-"} : files;
+    for (const string& name : inputs) {
+        int fd = name == "-" ? STDIN_FILENO : open(name.c_str(), O_RDONLY);
+        if (fd < 0) {
+            cerr << "Could not open " << name << endl;
+            ok = false;
+            continue;
+        }
+        string text, carry;
+        while (true) {
+            // Start each block with the word cut off at the end of the last one
+            text.swap(carry);
+            carry.clear();
+            size_t start = text.size();
+            text.resize(start + CHECK_BLOCK_BYTES);
+            ssize_t got = read(fd, &text[start], CHECK_BLOCK_BYTES);
+            if (got < 0 && errno == EINTR) {
+                text.resize(start);
+                carry.swap(text);
+                continue;
             }
-            else if (ch == 19) {  // Ctrl + S (Save)
-                save();
+            if (got < 0) {
+                cerr << "Could not read " << name << endl;
+                ok = false;
             }
-            else if (ch == 27) {  // ESC key to exit
-                SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), Colours[0]);   // Revert to original colour
-                
-                FILE *fp;
-                fp = fopen("word_count.txt", "w");   
-                if (!fp) {
-                    cout << "File did not open" << endl;
-                    exit(1);
-                }
-                fprintf(fp, "Current Word Count: %d", 0);  // Clear the word count to zero again.
-                fclose(fp);    
+            text.resize(start + max<ssize_t>(got, 0));
+            if (got <= 0) {
+                if (!text.empty()) submit(text);
                 break;
             }
-            else if (ch == 18) {    // Ctrl + R (Change Colour)
-                Colour_Itr++;   // Move to next colour in the palette
-                if (Colour_Itr == Colours.end()) Colour_Itr = Colours.begin();
-                setTextColor(*Colour_Itr);      // Set colour to next colour
-                continue;
+            size_t cut = text.size();
+            while (cut > 0 && !isspace((unsigned char)text[cut - 1])) cut--;
+            if (cut > 0) {
+                carry.assign(text, cut, string::npos);
+                text.resize(cut);
+                submit(text);
+            } else {
+                carry.swap(text);  // One enormous word, keep reading
             }
-            else if (ch == 32) {  // Space for autocorrect
-                string str = "";
-                stack<char> temp = left_st;
+        }
+        if (fd != STDIN_FILENO) close(fd);
+    }
 
-                // Collect characters until the last space (or the beginning of the line)
-                while (!temp.empty() && temp.top() != ' ') {
-                    str += temp.top(); // Append each character to str
-                    temp.pop();
-                }
-                // Reverse the extracted string to get the actual word
-                reverse(str.begin(), str.end());
-                transform(str.begin(), str.end(), str.begin(), ::tolower);
-                spellcheckAndSuggest(trie, str, "C:dictionary.txt");
-                left_st.push(' ');
-                cursorPosX++;
-            }
-
-            else if (ch == 9) { // TAB key for autocomplete
-                string str = "";
-                stack<char> temp = left_st;
-
-                // Collect characters until the last space (or the beginning of the line)
-                while (!temp.empty() && temp.top() != ' ') {
-                    str += temp.top(); // Append each character to str
-                    temp.pop();
-                }
+    writeFinished(0);
+    {
+        lock_guard<mutex> guard(lock);
+        finished = true;
+    }
+    workReady.notify_all();
+    for (thread& worker : workers) worker.join();
+    fflush(out);
+    return ok;
+}
 
-                // Reverse the extracted string to get the actual word
-                reverse(str.begin(), str.end());
-                transform(str.begin(), str.end(), str.begin(), ::tolower);
-                spellcheckAndSuggest(trie, str, "C:dictionary.txt");
-                cursorPosX += str.length(); // Move cursor to the end of the word
-            }
+// Latency Stats
+
+// Allocations one thread made through operator new, for allocations per
+// operation in the benchmarks and per stage in the latency stats. Only its
+// own thread writes a counter, with a plain store, so allocating never
+// touches a cache line other threads write. The counters are thread_local
+// data with nothing to construct or destroy, so allocations made while a
+// thread or the program is being torn down are safe to count. A counter is
+// linked (without allocating) on its thread's first allocation so total()
+// can sum the live counters, and unlinked when the thread exits; anything
+// the thread allocates after that goes straight to exited.
+class AllocationCounter {
+private:
+    enum State : uint8_t { NEW, LINKED, GONE };
+
+    // Unlinks the thread's counter as the thread exits
+    struct Leaver {
+        ~Leaver();
+    };
+
+    static mutex lock;                  // Guards the list and exited
+    static AllocationCounter* live;     // Counters of running threads
+    static uint64_t exited;             // Allocations of threads that have finished
+    AllocationCounter* prev = nullptr;
+    AllocationCounter* next = nullptr;
+    atomic<uint64_t> count{0};
+    State state = NEW;
+
+    __attribute__((noinline)) void addFirstOrLast() {
+        if (state == NEW) {
+            static thread_local Leaver leaver;  // Registered before linking, so it always runs
+            (void)leaver;
+        }
+        lock_guard<mutex> guard(lock);
+        if (state == GONE) {
+            exited++;
+            return;
         }
+        next = live;
+        if (live) live->prev = this;
+        live = this;
+        state = LINKED;
+        count.store(1, memory_order_relaxed);
+    }
+
+    void leave() {
+        lock_guard<mutex> guard(lock);
+        if (state == LINKED) {
+            exited += count.load(memory_order_relaxed);
+            if (prev) prev->next = next;
+            else live = next;
+            if (next) next->prev = prev;
+        }
+        state = GONE;
     }
-}
-// Check if the word exists in the hashmap
-if (auto_comp_word.find(str) != auto_comp_word.end()) {  // Updated variable name
-    string suggestion = auto_comp_word[str];  // Fetch the suggestion from the map
 
-    // Preserve the current right stack
-    stack<char> tempRight_st = right_st;  // Renamed rightStack to right_st
+public:
+    constexpr AllocationCounter() {}
+
+    AllocationCounter(const AllocationCounter&) = delete;
+    AllocationCounter& operator=(const AllocationCounter&) = delete;
+
+    void add() {
+        if (state == LINKED) count.store(count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        else addFirstOrLast();
+    }
 
-    // Remove the extracted word from leftStack
-    for (int i = 0; i < str.size(); ++i) {
-        left_st.pop();  // Updated leftStack to left_st
+    uint64_t value() const {
+        return count.load(memory_order_relaxed);
     }
 
-    // Insert the suggestion into leftStack
-    for (char c : suggestion) {
-        left_st.push(c);  // Insert each character of the suggestion
+    // Allocations made by every thread so far
+    static uint64_t total() {
+        lock_guard<mutex> guard(lock);
+        uint64_t sum = exited;
+        for (AllocationCounter* counter = live; counter; counter = counter->next) sum += counter->value();
+        return sum;
     }
+};
+
+mutex AllocationCounter::lock;
+AllocationCounter* AllocationCounter::live = nullptr;
+uint64_t AllocationCounter::exited = 0;
+thread_local AllocationCounter threadAllocations;
 
-    // Update cursor position
-    cursorPosX = left_st.size();  // Move cursor to the end of the newly inserted suggestion
+AllocationCounter::Leaver::~Leaver() {
+    threadAllocations.leave();
+}
 
-    // Restore the right stack
-    right_st = tempRight_st;  // Restore the original rightStack
+// Every form of operator new is replaced so the counts are complete, and
+// every form of delete to match. The replacements are kept out of line so
+// the compiler does not see malloc() and free() meeting new and delete
+// expressions.
+static void* countedMalloc(size_t size) noexcept {
+    threadAllocations.add();
+    return malloc(size ? size : 1);
+}
 
-    lines[currentLine] = left_st;  // Update the current line with the modified leftStack
-    displayText();
-    display_word_count();
-    setCursorPosition(cursorPosX, cursorPosY);  // Update the cursor position
+static void* countedAlignedAlloc(size_t size, align_val_t alignment) noexcept {
+    threadAllocations.add();
+    size_t align = (size_t)alignment;
+    return aligned_alloc(align, size ? (size + align - 1) / align * align : align);  // Size must be a multiple of align
 }
-else {  // Regular character input
-    insert_capital(ch);  // Insert character with capitalization if needed
-    cursorPosX++;  // Increment cursor position
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    if (void* block = countedMalloc(size)) return block;
+    throw bad_alloc();
 }
 
-displayText();  // Redraw the text after insertion
-display_word_count();  // Update word count
-setCursorPosition(cursorPosX, cursorPosY);  // Adjust cursor position
+__attribute__((noinline)) void* operator new[](size_t size) {
+    if (void* block = countedMalloc(size)) return block;
+    throw bad_alloc();
+}
 
-int main() {
-    loadDictionary(trie, "C:dictionary.txt");  // Load words from dictionary.txt
-    text_ed editor;  // Changed TextEditor to text_ed
-    editor.runEditor();  // Start the text editor
-    return 0;
+__attribute__((noinline)) void* operator new(size_t size, align_val_t alignment) {
+    if (void* block = countedAlignedAlloc(size, alignment)) return block;
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new[](size_t size, align_val_t alignment) {
+    if (void* block = countedAlignedAlloc(size, alignment)) return block;
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new(size_t size, const nothrow_t&) noexcept {
+    return countedMalloc(size);
+}
+
+__attribute__((noinline)) void* operator new[](size_t size, const nothrow_t&) noexcept {
+    return countedMalloc(size);
+}
+
+__attribute__((noinline)) void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+    return countedAlignedAlloc(size, alignment);
 }
 
+__attribute__((noinline)) void* operator new[](size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+    return countedAlignedAlloc(size, alignment);
+}
+
+__attribute__((noinline)) void operator delete(void* block) noexcept { free(block); }
+__attribute__((noinline)) void operator delete[](void* block) noexcept { free(block); }
+__attribute__((noinline)) void operator delete(void* block, size_t) noexcept { free(block); }
+__attribute__((noinline)) void operator delete[](void* block, size_t) noexcept { free(block); }
+__attribute__((noinline)) void operator delete(void* block, const nothrow_t&) noexcept { free(block); }
+__attribute__((noinline)) void operator delete[](void* block, const nothrow_t&) noexcept { free(block); }
+__attribute__((noinline)) void operator delete(void* block, align_val_t) noexcept { free(block); }
+__attribute__((noinline)) void operator delete[](void* block, align_val_t) noexcept { free(block); }
+__attribute__((noinline)) void operator delete(void* block, size_t, align_val_t) noexcept { free(block); }
+__attribute__((noinline)) void operator delete[](void* block, size_t, align_val_t) noexcept { free(block); }
+__attribute__((noinline)) void operator delete(void* block, align_val_t, const nothrow_t&) noexcept { free(block); }
+__attribute__((noinline)) void operator delete[](void* block, align_val_t, const nothrow_t&) noexcept { free(block); }
+
+// The parts of handling a key that are timed while latency stats are on
+enum LatencyStage {
+    STAGE_KEY_TO_PAINT,   // From reading a key to the end of the frame that shows it
+    STAGE_KEY,            // handleKey(), or applying a paste
+    STAGE_INSERT,         // insert_capital()
+    STAGE_UNDO,           // Recording an edit in the undo history
+    STAGE_JOURNAL,        // Queueing an edit for the crash journal
+    STAGE_STATE,          // isStateChanged()
+    STAGE_PAINT,          // displayText()
+    STAGE_WORD_COUNT,     // display_word_count() writing word_count.txt
+    STAGE_SPELL_QUEUE,    // Handing a word or line to the spellcheck worker
+    STAGE_SPELL_LOG,      // The worker checking a word and logging suggestions
+    STAGE_SPELL_LINE,     // The worker finding the misspellings on a line
+    STAGE_COMPLETE,       // Ranking the completions of the word being typed
+    STAGE_COUNT
+};
+
+const char* const STAGE_NAMES[STAGE_COUNT] = {
+    "key_to_paint", "key", "insert_capital", "undo_record", "journal_record", "isStateChanged",
+    "displayText", "display_word_count", "spell_queue", "spell_log", "spell_line", "complete"
+};
+
+// Clock for the latency stats: the time stamp counter where there is one,
+// which takes a few nanoseconds to read, otherwise the steady clock
+inline uint64_t latencyTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Log-linear histogram of durations in clock ticks, in the style of an HDR
+// histogram: exact below 64 ticks, then 32 buckets per power of two, so any
+// value is reported to within about 3%. Each histogram has one writing
+// thread; the counters are atomic only so a dump can read them meanwhile.
+class LatencyHistogram {
+private:
+    static const int SUB_BITS = 5;
+    static const size_t SUB_BUCKETS = 1 << SUB_BITS;
+    static const size_t BUCKETS = 2 * SUB_BUCKETS + (63 - SUB_BITS) * SUB_BUCKETS;
+    atomic<uint64_t> counts[BUCKETS];
+    atomic<uint64_t> samples, totalTicks, maxTicks, allocations;
+
+    static void add(atomic<uint64_t>& counter, uint64_t amount) {
+        counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+
+    static size_t bucketOf(uint64_t ticks) {
+        if (ticks < 2 * SUB_BUCKETS) return ticks;
+        int exponent = 63 - __builtin_clzll(ticks);
+        return 2 * SUB_BUCKETS + (exponent - SUB_BITS - 1) * SUB_BUCKETS + ((ticks >> (exponent - SUB_BITS)) - SUB_BUCKETS);
+    }
+
+    // Middle of the range of values that land in bucket
+    static uint64_t valueOf(size_t bucket) {
+        if (bucket < 2 * SUB_BUCKETS) return bucket;
+        int shift = (bucket - 2 * SUB_BUCKETS) / SUB_BUCKETS + 1;
+        uint64_t low = (SUB_BUCKETS + (bucket - 2 * SUB_BUCKETS) % SUB_BUCKETS) << shift;
+        return low + (uint64_t(1) << shift) / 2;
+    }
+
+public:
+    LatencyHistogram() {
+        reset();
+    }
+
+    void reset() {
+        for (auto& count : counts) count.store(0, memory_order_relaxed);
+        for (auto* counter : {&samples, &totalTicks, &maxTicks, &allocations}) counter->store(0, memory_order_relaxed);
+    }
+
+    void record(uint64_t ticks, uint64_t allocated) {
+        add(counts[bucketOf(ticks)], 1);
+        add(samples, 1);
+        add(totalTicks, ticks);
+        add(allocations, allocated);
+        if (ticks > maxTicks.load(memory_order_relaxed)) maxTicks.store(ticks, memory_order_relaxed);
+    }
+
+    uint64_t count() const { return samples.load(memory_order_relaxed); }
+    uint64_t total() const { return totalTicks.load(memory_order_relaxed); }
+    uint64_t maximum() const { return maxTicks.load(memory_order_relaxed); }
+    uint64_t allocated() const { return allocations.load(memory_order_relaxed); }
+
+    // Ticks at or below which the fraction q of the samples fall
+    uint64_t quantile(double q) const {
+        uint64_t wanted = max<uint64_t>(1, ceil(q * count())), seen = 0;
+        for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+            seen += counts[bucket].load(memory_order_relaxed);
+            if (seen >= wanted) return min(valueOf(bucket), maximum());
+        }
+        return maximum();
+    }
+};
+
+// Where the time goes while handling keys, stage by stage. Off until
+// enable(); while off each timed stage costs one load and a branch.
+class LatencyStats {
+private:
+    atomic<bool> on{false};
+    LatencyHistogram stages[STAGE_COUNT];
+    uint64_t startTicks = 0;    // Clock readings when enabled, to turn ticks into time
+    chrono::steady_clock::time_point startTime;
+
+public:
+    bool enabled() const {
+        return on.load(memory_order_relaxed);
+    }
+
+    // Start collecting, from empty histograms
+    void enable() {
+        for (auto& stage : stages) stage.reset();
+        startTime = chrono::steady_clock::now();
+        startTicks = latencyTicks();
+        on.store(true, memory_order_relaxed);
+    }
+
+    void disable() {
+        on.store(false, memory_order_relaxed);
+    }
+
+    void record(LatencyStage stage, uint64_t ticks, uint64_t allocated) {
+        stages[stage].record(ticks, allocated);
+    }
+
+    // Write a table of every stage that ran: how often, the mean, p50, p99,
+    // p99.9 and worst time, and allocations per call. False if path could
+    // not be written.
+    bool dump(const string& path) const {
+        FILE* out = fopen(path.c_str(), "w");
+        if (!out) return false;
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+        double ticksPerUs = seconds > 0 ? (latencyTicks() - startTicks) / (seconds * 1e6) : 1;
+        if (ticksPerUs <= 0) ticksPerUs = 1;
+        fprintf(out, "Latency over the last %.1f s\n", seconds);
+        fprintf(out, "%-20s %10s %10s %10s %10s %10s %10s %10s\n", "stage", "count", "mean us", "p50 us", "p99 us",
+                "p99.9 us", "max us", "allocs");
+        for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+            const LatencyHistogram& times = stages[stage];
+            uint64_t count = times.count();
+            if (count == 0) continue;
+            fprintf(out, "%-20s %10llu %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n", STAGE_NAMES[stage],
+                    (unsigned long long)count, times.total() / ticksPerUs / count, times.quantile(0.5) / ticksPerUs,
+                    times.quantile(0.99) / ticksPerUs, times.quantile(0.999) / ticksPerUs,
+                    times.maximum() / ticksPerUs, (double)times.allocated() / count);
+        }
+        fclose(out);
+        return true;
+    }
+};
+
+LatencyStats latencyStats;
+
+// Times the rest of the enclosing block as one stage, and counts the
+// allocations the thread makes in it, while latency stats are on
+class StageTimer {
+private:
+    LatencyStage stage;
+    uint64_t start = 0;
+    uint64_t allocations = 0;
+
+public:
+    explicit StageTimer(LatencyStage stage) : stage(stage) {
+        if (!latencyStats.enabled()) return;
+        allocations = threadAllocations.value();
+        start = latencyTicks();
+    }
+
+    ~StageTimer() {
+        if (start) latencyStats.record(stage, latencyTicks() - start, threadAllocations.value() - allocations);
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+};
+
+// Single-producer single-consumer ring buffer. Exactly one thread pushes
+// and one thread pops, so each end owns one index and the two only meet
+// through atomic loads and stores, never a lock. Capacity is a power of two.
+template <typename T, size_t Capacity>
+class SpscQueue {
+private:
+    T slots[Capacity];
+    alignas(64) atomic<size_t> head{0};  // Next slot to pop, advanced by the consumer
+    alignas(64) atomic<size_t> tail{0};  // Next slot to fill, advanced by the producer
+
+public:
+    // Producer side; false if the queue is full
+    bool push(T&& value) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == Capacity) return false;
+        slots[t & (Capacity - 1)] = move(value);
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    // Consumer side; false if the queue is empty
+    bool pop(T& value) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) return false;
+        value = move(slots[h & (Capacity - 1)]);
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+};
+
+// Work for the spellcheck worker: a word just typed, to log suggestions
+// for, or a whole line to find the misspellings in
+struct SpellRequest {
+    bool wholeLine;
+    uint64_t key;    // Line key to send back with the result
+    string text;
+};
+
+// Misspellings found on a line: start and length of each misspelt word
+typedef vector<pair<uint32_t, uint32_t>> Misspellings;
+
+// A checked line, sent back from the spellcheck worker
+struct SpellResult {
+    uint64_t key;
+    Misspellings misspelt;
+    uint64_t version;   // Dictionary version it was checked against
+};
+
+// Spellchecks words on a background thread so the editor never waits on
+// dictionary lookups, corrections or the log file. Words go to the worker
+// through a lock-free queue and verdicts come back through another; each
+// side is woken through a pipe, so the editor can poll for results next to
+// the keyboard. The worker reads the dictionary through snapshots, so a
+// word added or a reload never makes it wait.
+class SpellChecker {
+private:
+    static const size_t QUEUE_SIZE = 1024;
+    DictionaryStore& store;
+    WordCounts usage;      // Correct words the user wrote, kept by the worker
+    string logPath;
+    SpscQueue<SpellRequest, QUEUE_SIZE> requests; // Editor -> worker
+    SpscQueue<SpellResult, QUEUE_SIZE> results; // Worker -> editor
+    int workerWake[2];     // Pipe the worker sleeps on
+    int editorWake[2];     // Pipe the editor polls for results
+    atomic<bool> stopping{false};
+    thread worker;
+
+    static void signal(int fd) {
+        char byte = 1;
+        ssize_t ignored = ::write(fd, &byte, 1);  // A full pipe already wakes the reader
+        (void)ignored;
+    }
+
+    bool submit(SpellRequest&& request) {
+        StageTimer timer(STAGE_SPELL_QUEUE);
+        if (!requests.push(move(request))) return false;
+        signal(workerWake[1]);
+        return true;
+    }
+
+    static void drain(int fd) {
+        char bytes[256];
+        while (read(fd, bytes, sizeof(bytes)) > 0) {}
+    }
+
+    void run() {
+        ofstream log(logPath, ios::app);  // Kept open for the whole session
+        while (true) {
+            pollfd wake = {workerWake[0], POLLIN, 0};
+            if (poll(&wake, 1, -1) < 0 && errno != EINTR) break;
+            drain(workerWake[0]);
+            bool published = false;
+            SpellRequest request;
+            DictionaryStore::Reader dict = store.read();
+            while (requests.pop(request)) {
+                if (!request.wholeLine) {
+                    StageTimer timer(STAGE_SPELL_LOG);
+                    verifyWord(*dict, usage, request.text, log);
+                    continue;
+                }
+                SpellResult result = {request.key, {}, dict->number};
+                {
+                    StageTimer timer(STAGE_SPELL_LINE);
+                    forEachWord(request.text.data(), request.text.size(), [&](size_t start, size_t end, const string& word) {
+                        if (!dict->exists(word)) result.misspelt.push_back({start, end - start});
+                    });
+                }
+                // The editor drains results every loop, so this only waits if it is very busy
+                while (!results.push(move(result))) this_thread::sleep_for(chrono::milliseconds(1));
+                published = true;
+            }
+            log.flush();
+            if (published) signal(editorWake[1]);
+            if (stopping.load()) break;
+        }
+    }
+
+public:
+    SpellChecker(DictionaryStore& store, const string& logPath) : store(store), logPath(logPath) {
+        if (pipe(workerWake) != 0 || pipe(editorWake) != 0) {
+            cout << "Could not start the spellchecker" << endl;
+            exit(1);
+        }
+        for (int fd : {workerWake[0], workerWake[1], editorWake[0], editorWake[1]}) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+        worker = thread(&SpellChecker::run, this);
+    }
+
+    SpellChecker(const SpellChecker&) = delete;
+    SpellChecker& operator=(const SpellChecker&) = delete;
+
+    // Let the worker finish the words already queued, then stop it
+    ~SpellChecker() {
+        stopping.store(true);
+        signal(workerWake[1]);
+        worker.join();
+        for (int fd : {workerWake[0], workerWake[1], editorWake[0], editorWake[1]}) close(fd);
+    }
+
+    // Queue a word to log suggestions for, without waiting. If the worker
+    // has fallen a whole queue behind the word is dropped and false is returned.
+    bool check(const string& word) {
+        return submit({false, 0, word});
+    }
+
+    // Queue a line to be checked; its misspellings come back tagged with key
+    bool checkLine(uint64_t key, const string& text) {
+        return submit({true, key, text});
+    }
+
+    // Readable when the worker has published results
+    int resultFd() const {
+        return editorWake[0];
+    }
+
+    // Take the next checked line, if any
+    bool nextResult(SpellResult& result) {
+        drain(editorWake[0]);
+        return results.pop(result);
+    }
+};
+
+// Spellcheck Server
+
+// Queries other programs can send to texted --serve
+enum QueryOp : uint8_t {
+    QUERY_EXISTS = 1,    // Whether the word is in the dictionary
+    QUERY_SUGGEST = 2,   // Completions of a prefix, most common first
+    QUERY_CORRECT = 3,   // Corrections of a misspelt word, nearest first
+    QUERY_ERROR = 255    // Sent back for a query the server does not know
+};
+
+// A query on the wire is this header followed by length bytes of word.
+// Fields are in the host's byte order, as client and server share a machine.
+struct QueryHeader {
+    uint32_t id;       // Echoed in the answer
+    uint8_t op;        // QueryOp
+    uint8_t limit;     // Most words wanted, 0 for the server's default
+    uint16_t length;   // Bytes of word that follow
+};
+
+// An answer is this header followed by count words, each a length byte and
+// its letters. For QUERY_EXISTS count is 1 if the word exists and 0 if not.
+struct AnswerHeader {
+    uint32_t id;
+    uint8_t op;        // The query's op, or QUERY_ERROR
+    uint8_t count;
+    uint16_t length;   // Bytes of words that follow
+};
+
+static_assert(sizeof(QueryHeader) == 8 && sizeof(AnswerHeader) == 8, "wire headers must not be padded");
+
+// Append the answer to one query. Words are cleaned the way the
+// spellchecker cleans them, so "Hello," is looked up as "hello".
+void answerQuery(const DictionaryVersion& dict, const QueryHeader& query, const char* word, string& out) {
+    AnswerHeader answer = {query.id, query.op, 0, 0};
+    string text = cleanWord(string(word, query.length));
+    int limit = query.limit ? query.limit : -1;
+    vector<string> words;
+    if (query.op == QUERY_EXISTS) {
+        answer.count = dict.exists(text);
+    } else if (query.op == QUERY_SUGGEST) {
+        words = dict.suggest(text, limit);
+    } else if (query.op == QUERY_CORRECT) {
+        words = dict.corrections(text, 2, limit);
+    } else {
+        answer.op = QUERY_ERROR;
+    }
+    size_t start = out.size();
+    out.append(sizeof(answer), '\0');
+    for (const string& found : words) {
+        if (answer.count == UINT8_MAX) break;
+        if (found.size() > UINT8_MAX) continue;
+        out += (char)found.size();
+        out += found;
+        answer.count++;
+    }
+    answer.length = out.size() - start - sizeof(answer);
+    memcpy(&out[start], &answer, sizeof(answer));
+}
+
+// Answers spellcheck queries from other programs over a Unix domain socket,
+// so they share one loaded dictionary instead of each loading their own.
+// Clients may pipeline queries: a worker reads everything a client has
+// sent, answers every complete query and writes the answers with one
+// write(). Each worker runs its own epoll loop and they share the listening
+// socket (EPOLLEXCLUSIVE wakes one of them per new connection), so a client
+// stays with the worker that accepted it and no connection is shared.
+// Each batch of queries is answered from a dictionary snapshot, so the
+// workers need no locks and a reload never holds them up.
+class SpellServer {
+private:
+    struct Connection {
+        string in, out;          // Unanswered queries, unsent answers
+        size_t sent = 0;         // Bytes of out already written
+        bool blocked = false;    // Waiting for the client to read; its queries wait meanwhile
+    };
+
+    struct Worker {
+        int epollFd = -1;
+        unordered_map<int, Connection> connections;
+        thread loop;
+    };
+
+    DictionaryStore& store;
+    string path;
+    int listenFd = -1;
+    int stopFd = -1;     // eventfd that becomes readable to stop every worker
+    vector<unique_ptr<Worker>> workers;
+
+    static bool hasQuery(const string& in) {
+        QueryHeader query;
+        if (in.size() < sizeof(query)) return false;
+        memcpy(&query, in.data(), sizeof(query));
+        return in.size() - sizeof(query) >= query.length;
+    }
+
+    // Answer complete queries until they run out or the answers pile up
+    void answer(Connection& client) {
+        DictionaryStore::Reader dict = store.read();
+        size_t used = 0;
+        QueryHeader query;
+        while (client.in.size() - used >= sizeof(query) && client.out.size() - client.sent < SERVE_OUTPUT_LIMIT) {
+            memcpy(&query, client.in.data() + used, sizeof(query));
+            if (client.in.size() - used - sizeof(query) < query.length) break;
+            answerQuery(*dict, query, client.in.data() + used + sizeof(query), client.out);
+            used += sizeof(query) + query.length;
+        }
+        client.in.erase(0, used);
+    }
+
+    // Write as much of the answers as the socket takes. False on an error,
+    // such as the client having gone (MSG_NOSIGNAL keeps that from raising SIGPIPE).
+    static bool flush(int fd, Connection& client) {
+        while (client.sent < client.out.size()) {
+            ssize_t n = send(fd, client.out.data() + client.sent, client.out.size() - client.sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                client.sent += n;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else {
+                if (n < 0 && errno == EAGAIN) break;
+                return false;
+            }
+        }
+        if (client.sent == client.out.size()) {
+            client.out.clear();
+            client.sent = 0;
+        }
+        return true;
+    }
+
+    // Handle a ready client. False once it should be closed.
+    bool serve(Worker& worker, int fd) {
+        Connection& client = worker.connections[fd];
+        bool open = true;
+        if (!client.blocked) {
+            char chunk[65536];
+            while (true) {
+                ssize_t n = read(fd, chunk, sizeof(chunk));
+                if (n > 0) {
+                    client.in.append(chunk, n);
+                    if (n < (ssize_t)sizeof(chunk)) break;   // Drained; epoll reports anything newer
+                } else if (n < 0 && errno == EINTR) {
+                    continue;
+                } else {
+                    open = n < 0 && errno == EAGAIN;
+                    break;
+                }
+            }
+        }
+        while (true) {
+            answer(client);
+            if (!flush(fd, client)) return false;
+            if (!client.out.empty() || !hasQuery(client.in)) break;
+        }
+        bool blocked = !client.out.empty();
+        if (blocked != client.blocked) {
+            client.blocked = blocked;
+            epoll_event event = {};
+            event.events = blocked ? EPOLLOUT : EPOLLIN;
+            event.data.fd = fd;
+            epoll_ctl(worker.epollFd, EPOLL_CTL_MOD, fd, &event);
+        }
+        return open || blocked;   // Answers still owed are sent before closing
+    }
+
+    void run(Worker& worker) {
+        epoll_event events[64];
+        while (true) {
+            int ready = epoll_wait(worker.epollFd, events, 64, -1);
+            if (ready < 0 && errno != EINTR) break;
+            for (int i = 0; i < ready; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == stopFd) return;
+                if (fd == listenFd) {
+                    // One connection per wakeup, so new clients spread over the workers
+                    int client = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (client < 0) continue;
+                    epoll_event event = {};
+                    event.events = EPOLLIN;
+                    event.data.fd = client;
+                    epoll_ctl(worker.epollFd, EPOLL_CTL_ADD, client, &event);
+                    worker.connections[client];
+                } else if (!serve(worker, fd)) {
+                    worker.connections.erase(fd);
+                    ::close(fd);   // Also removes it from the epoll set
+                }
+            }
+        }
+    }
+
+public:
+    explicit SpellServer(DictionaryStore& store) : store(store) {}
+
+    SpellServer(const SpellServer&) = delete;
+    SpellServer& operator=(const SpellServer&) = delete;
+
+    ~SpellServer() {
+        stop();
+    }
+
+    // Listen on socketPath and answer queries on up to threads workers. A
+    // socket file left behind by a server that is gone is replaced. False
+    // with error set if the server could not start.
+    bool start(const string& socketPath, unsigned threads, string& error) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path)) {
+            error = "Socket path is empty or too long: " + socketPath;
+            return false;
+        }
+        memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) {
+            error = string("Could not create a socket: ") + strerror(errno);
+            return false;
+        }
+        bool bound = ::bind(listenFd, (sockaddr*)&address, sizeof(address)) == 0;
+        if (!bound && errno == EADDRINUSE) {
+            int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            bool live = probe >= 0 && ::connect(probe, (sockaddr*)&address, sizeof(address)) == 0;
+            if (probe >= 0) ::close(probe);
+            if (!live) {
+                unlink(socketPath.c_str());
+                bound = ::bind(listenFd, (sockaddr*)&address, sizeof(address)) == 0;
+            }
+        }
+        if (!bound || listen(listenFd, SOMAXCONN) != 0) {
+            error = "Could not listen on " + socketPath + ": " + strerror(errno);
+            ::close(listenFd);
+            listenFd = -1;
+            return false;
+        }
+        path = socketPath;
+        stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        for (unsigned t = 0; t < max(1u, threads); ++t) {
+            unique_ptr<Worker> worker(new Worker);
+            worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+            epoll_event event = {};
+            event.events = EPOLLIN | EPOLLEXCLUSIVE;
+            event.data.fd = listenFd;
+            epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, listenFd, &event);
+            event.events = EPOLLIN;
+            event.data.fd = stopFd;
+            epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, stopFd, &event);
+            worker->loop = thread(&SpellServer::run, this, ref(*worker));
+            workers.push_back(move(worker));
+        }
+        return true;
+    }
+
+    // Stop the workers, drop every client and remove the socket file
+    void stop() {
+        if (listenFd < 0) return;
+        uint64_t one = 1;
+        if (::write(stopFd, &one, sizeof(one)) < 0) {}   // The counter cannot overflow from one write
+        for (auto& worker : workers) {
+            worker->loop.join();
+            for (auto& client : worker->connections) ::close(client.first);
+            ::close(worker->epollFd);
+        }
+        workers.clear();
+        ::close(listenFd);
+        ::close(stopFd);
+        listenFd = stopFd = -1;
+        unlink(path.c_str());
+    }
+};
+
+// An answer from the spellcheck server
+struct SpellAnswer {
+    uint32_t id = 0;
+    uint8_t op = 0;           // The query's op, or QUERY_ERROR
+    bool exists = false;      // For QUERY_EXISTS
+    vector<string> words;     // For QUERY_SUGGEST and QUERY_CORRECT
+};
+
+// Connection to a SpellServer. ask() only queues a query, so a batch of
+// them goes out in one write(); answers come back in the order asked.
+// Batches of a few hundred queries keep both sides from waiting on each other.
+class SpellClient {
+private:
+    int fd = -1;
+    string out;          // Queries not yet sent
+    string in;           // Bytes of answers read but not yet returned
+    size_t inPos = 0;
+    uint32_t nextId = 1;
+
+    // Whether a whole answer has been read; its header goes to header
+    bool buffered(AnswerHeader& header) const {
+        if (in.size() - inPos < sizeof(header)) return false;
+        memcpy(&header, in.data() + inPos, sizeof(header));
+        return in.size() - inPos - sizeof(header) >= header.length;
+    }
+
+public:
+    ~SpellClient() {
+        if (fd >= 0) ::close(fd);
+    }
+
+    bool connect(const string& socketPath) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path)) return false;
+        memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        return fd >= 0 && ::connect(fd, (sockaddr*)&address, sizeof(address)) == 0;
+    }
+
+    // Queue a query; returns the id its answer will carry
+    uint32_t ask(QueryOp op, const string& word, int limit = 0) {
+        QueryHeader query = {nextId++, op, (uint8_t)min(max(limit, 0), (int)UINT8_MAX),
+                             (uint16_t)min(word.size(), (size_t)UINT16_MAX)};
+        out.append((const char*)&query, sizeof(query));
+        out.append(word, 0, query.length);
+        return query.id;
+    }
+
+    // Send the queued queries. False if the server has gone.
+    bool flush() {
+        size_t sent = 0;
+        while (sent < out.size()) {
+            ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            sent += n;
+        }
+        out.clear();
+        return true;
+    }
+
+    // Wait for the next answer, sending queued queries first. False if the
+    // server has gone.
+    bool nextAnswer(SpellAnswer& answer) {
+        if (!out.empty() && !flush()) return false;
+        AnswerHeader header;
+        while (!buffered(header)) {
+            if (inPos > 0) {
+                in.erase(0, inPos);
+                inPos = 0;
+            }
+            char chunk[65536];
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            in.append(chunk, n);
+        }
+        const char* data = in.data() + inPos + sizeof(header);
+        answer.id = header.id;
+        answer.op = header.op;
+        answer.exists = header.op == QUERY_EXISTS && header.count;
+        answer.words.clear();
+        if (header.op != QUERY_EXISTS) {
+            const char* end = data + header.length;
+            for (int i = 0; i < header.count && data < end; ++i) {
+                size_t length = (unsigned char)*data++;
+                answer.words.emplace_back(data, min(length, (size_t)(end - data)));
+                data += answer.words.back().size();
+            }
+        }
+        inPos += sizeof(header) + header.length;
+        return true;
+    }
+};
+
+// Serve the dictionary in store on socketPath until SIGINT or SIGTERM.
+// SIGHUP reloads the word list while queries go on being answered.
+bool serveDictionary(DictionaryStore& store, const string& socketPath) {
+    // The workers inherit the blocked signals, so only sigwait() sees them
+    sigset_t handled;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGINT);
+    sigaddset(&handled, SIGTERM);
+    sigaddset(&handled, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &handled, nullptr);
+
+    SpellServer server(store);
+    string error;
+    if (!server.start(socketPath, min(SERVE_MAX_THREADS, max(1u, thread::hardware_concurrency())), error)) {
+        cerr << error << endl;
+        return false;
+    }
+    cerr << "Serving the dictionary on " << socketPath << endl;
+    int received;
+    while (sigwait(&handled, &received) == 0 && received == SIGHUP) store.reload();
+    server.stop();
+    return true;
+}
+
+// Send the queries read from in, one per line ("exists word", "suggest
+// prefix" or "correct word"), to the server on socketPath and print one
+// line per answer: "yes" or "no", or the words found.
+bool runQueries(const string& socketPath, istream& in, FILE* out) {
+    SpellClient client;
+    if (!client.connect(socketPath)) {
+        cerr << "Could not connect to " << socketPath << endl;
+        return false;
+    }
+    static const map<string, QueryOp> ops = {{"exists", QUERY_EXISTS}, {"suggest", QUERY_SUGGEST}, {"correct", QUERY_CORRECT}};
+    string line;
+    bool more = true;
+    while (more) {
+        size_t asked = 0;
+        while (asked < QUERY_BATCH && (more = (bool)getline(in, line))) {
+            istringstream fields(line);
+            string op, word;
+            fields >> op >> word;
+            auto known = ops.find(op);
+            client.ask(known == ops.end() ? QUERY_ERROR : known->second, word);
+            asked++;
+        }
+        SpellAnswer answer;
+        for (size_t i = 0; i < asked; ++i) {
+            if (!client.nextAnswer(answer)) {
+                cerr << "The server closed the connection" << endl;
+                return false;
+            }
+            if (answer.op == QUERY_ERROR) {
+                fprintf(out, "error\n");
+            } else if (answer.op == QUERY_EXISTS) {
+                fprintf(out, answer.exists ? "yes\n" : "no\n");
+            } else {
+                string words;
+                for (const string& word : answer.words) words += (words.empty() ? "" : " ") + word;
+                fprintf(out, "%s\n", words.c_str());
+            }
+        }
+    }
+    fflush(out);
+    return true;
+}
+
+// Global dictionary object
+DictionaryStore wordBase;
+
+// Text Buffer
+
+// Number of times ch occurs in text[0, len), 16 bytes at a time with SSE2
+size_t countIn(const char* text, size_t len, char ch) {
+    size_t total = 0, i = 0;
+#ifdef __SSE2__
+    const __m128i target = _mm_set1_epi8(ch);
+    for (; i + 16 <= len; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+        total += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, target)));
+    }
+#endif
+    for (; i < len; ++i) total += text[i] == ch;
+    return total;
+}
+
+// Position of the n-th (1-based) ch in text[0, len), or len if there are
+// fewer; n is reduced by the number passed over. Whole blocks are counted
+// first so only the block holding the answer is searched a byte at a time.
+size_t findNthIn(const char* text, size_t len, char ch, size_t& n) {
+    const size_t BLOCK = 64;
+    size_t i = 0;
+    for (; i + BLOCK <= len; i += BLOCK) {
+        size_t found = countIn(text + i, BLOCK, ch);
+        if (found >= n) break;
+        n -= found;
+    }
+    for (; i < len; ++i) {
+        if (text[i] == ch && --n == 0) return i;
+    }
+    return len;
+}
+
+// A gap buffer keeps a run of text in a single array with an empty "gap" at
+// the edit point. Typing and deleting only touch the gap edges, so they are
+// amortized O(1); the gap is moved lazily when the edit point changes.
+class GapBuffer {
+private:
+    vector<char> data;
+    size_t gapStart = 0;   // First free slot
+    size_t gapEnd = 0;     // One past the last free slot
+
+    // Make sure the gap can hold at least `needed` more characters
+    void reserveGap(size_t needed) {
+        if (gapEnd - gapStart >= needed) return;
+        size_t tail = data.size() - gapEnd;
+        size_t newCapacity = max(data.size() * 2, data.size() + needed + 16);
+        data.resize(newCapacity);
+        memmove(&data[newCapacity - tail], &data[gapEnd], tail);
+        gapEnd = newCapacity - tail;
+    }
+
+    // Move the gap so that it starts at logical position pos
+    void moveGap(size_t pos) {
+        if (pos < gapStart) {
+            size_t count = gapStart - pos;
+            memmove(&data[gapEnd - count], &data[pos], count);
+            gapStart -= count;
+            gapEnd -= count;
+        } else if (pos > gapStart) {
+            size_t count = pos - gapStart;
+            memmove(&data[gapStart], &data[gapEnd], count);
+            gapStart += count;
+            gapEnd += count;
+        }
+    }
+
+public:
+    size_t size() const {
+        return data.size() - (gapEnd - gapStart);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // Character at logical position i
+    char at(size_t i) const {
+        return i < gapStart ? data[i] : data[i + (gapEnd - gapStart)];
+    }
+
+    // The text before and after the gap, as two contiguous spans
+    pair<const char*, size_t> front() const {
+        return {data.data(), gapStart};
+    }
+    pair<const char*, size_t> back() const {
+        return {data.data() + gapEnd, data.size() - gapEnd};
+    }
+
+    // Insert len characters before logical position pos
+    void insert(size_t pos, const char* text, size_t len) {
+        if (len == 0) return;
+        reserveGap(len);
+        moveGap(pos);
+        memcpy(&data[gapStart], text, len);
+        gapStart += len;
+    }
+
+    // Remove len characters starting at logical position pos
+    void erase(size_t pos, size_t len) {
+        moveGap(pos);
+        gapEnd += len;
+    }
+
+    // Append the contents of another buffer at the end of this one
+    void append(const GapBuffer& other) {
+        insert(size(), other.front().first, other.front().second);
+        insert(size(), other.back().first, other.back().second);
+    }
+
+    // Cut everything from pos onwards into a new buffer
+    GapBuffer split(size_t pos) {
+        GapBuffer tail;
+        moveGap(pos);
+        tail.data.assign(data.begin() + gapEnd, data.end());
+        tail.gapStart = tail.gapEnd = tail.data.size();
+        data.resize(gapStart);
+        gapEnd = gapStart;
+        return tail;
+    }
+
+    // Number of times ch occurs in [from, to)
+    size_t count(char ch, size_t from, size_t to) const {
+        size_t total = 0;
+        if (from < gapStart) total += countIn(&data[from], min(to, gapStart) - from, ch);
+        if (to > gapStart) {
+            size_t gap = gapEnd - gapStart;
+            total += countIn(&data[0] + max(from, gapStart) + gap, to - max(from, gapStart), ch);
+        }
+        return total;
+    }
+
+    // Position of the n-th (1-based) occurrence of ch, or size() if there is none
+    size_t findNth(char ch, size_t n) const {
+        size_t at = findNthIn(data.data(), gapStart, ch, n);
+        if (at < gapStart) return at;
+        at = findNthIn(data.data() + gapEnd, data.size() - gapEnd, ch, n);
+        return at < data.size() - gapEnd ? gapStart + at : size();
+    }
+
+    // Copy the characters in [from, to) onto the end of out
+    void appendTo(string& out, size_t from, size_t to) const {
+        if (from < gapStart) out.append(&data[from], min(to, gapStart) - from);
+        if (to > gapStart) {
+            from = max(from, gapStart);
+            out.append(&data[from + (gapEnd - gapStart)], to - from);
+        }
+    }
+};
+
+// A file opened read-only through mmap, for documents too large to read
+// up front. Its text is handed to the rope in fixed-size chunks that stay
+// in the mapping until edited. Background threads count the newlines and
+// word starts of every chunk with pread(), so the count does not pull the
+// whole file into this process's resident memory.
+class MappedFile {
+public:
+    static constexpr size_t CHUNK = 64 * 1024;   // Bytes per rope leaf taken from the file
+    static constexpr uint32_t UNKNOWN = UINT32_MAX;
+
+private:
+    int fd = -1;
+    char* base = nullptr;
+    size_t length = 0;
+    size_t chunkCount = 0;
+    unique_ptr<atomic<uint32_t>[]> newlineCounts;   // Per chunk, UNKNOWN until scanned
+    unique_ptr<atomic<uint32_t>[]> wordCounts;      // Words starting in each chunk
+    atomic<size_t> nextChunk{0};
+    atomic<size_t> finishedChunks{0};
+    atomic<bool> stopping{false};
+    vector<thread> scanners;
+
+    MappedFile() {}
+
+    // Count chunks until none are left. Each chunk is read together with the
+    // byte before it, so a word running across a chunk boundary counts once.
+    void scan() {
+        vector<char> buffer(CHUNK + 1);
+        while (!stopping.load(memory_order_relaxed)) {
+            size_t chunk = nextChunk.fetch_add(1);
+            if (chunk >= chunkCount) break;
+            size_t start = chunk * CHUNK;
+            size_t len = min(CHUNK, length - start);
+            size_t lead = chunk > 0 ? 1 : 0;
+            size_t got = 0;
+            while (got < len + lead) {
+                ssize_t n = pread(fd, buffer.data() + got, len + lead - got, start - lead + got);
+                if (n <= 0) break;
+                got += n;
+            }
+            if (got < len + lead) {  // Unreadable, leave it to be counted through the mapping
+                finishedChunks.fetch_add(1);
+                continue;
+            }
+            uint32_t newlines = 0, words = 0;
+            bool inWord = lead && !isspace((unsigned char)buffer[0]);
+            for (size_t i = lead; i < len + lead; ++i) {
+                char c = buffer[i];
+                newlines += c == '\n';
+                bool space = isspace((unsigned char)c);
+                words += !space && !inWord;
+                inWord = !space;
+            }
+            wordCounts[chunk].store(words, memory_order_relaxed);
+            newlineCounts[chunk].store(newlines, memory_order_release);
+            finishedChunks.fetch_add(1);
+        }
+    }
+
+public:
+    // Map path and start counting it in the background; nullptr if it cannot be opened
+    static shared_ptr<MappedFile> open(const string& path) {
+        shared_ptr<MappedFile> file(new MappedFile());
+        file->fd = ::open(path.c_str(), O_RDONLY);
+        if (file->fd < 0) return nullptr;
+        struct stat info;
+        if (fstat(file->fd, &info) != 0 || !S_ISREG(info.st_mode)) return nullptr;
+        file->length = info.st_size;
+        if (file->length > 0) {
+            void* data = mmap(nullptr, file->length, PROT_READ, MAP_PRIVATE, file->fd, 0);
+            if (data == MAP_FAILED) return nullptr;
+            file->base = (char*)data;
+        }
+        file->chunkCount = (file->length + CHUNK - 1) / CHUNK;
+        file->newlineCounts.reset(new atomic<uint32_t>[file->chunkCount]);
+        file->wordCounts.reset(new atomic<uint32_t>[file->chunkCount]);
+        for (size_t i = 0; i < file->chunkCount; ++i) {
+            file->newlineCounts[i].store(UNKNOWN, memory_order_relaxed);
+            file->wordCounts[i].store(0, memory_order_relaxed);
+        }
+        unsigned threads = max(1u, thread::hardware_concurrency());
+        for (unsigned t = 0; t < threads && t < file->chunkCount; ++t) {
+            file->scanners.emplace_back(&MappedFile::scan, file.get());
+        }
+        return file;
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        stopping.store(true);
+        for (thread& scanner : scanners) scanner.join();
+        if (base) munmap(base, length);
+        if (fd >= 0) close(fd);
+    }
+
+    const char* data() const {
+        return base;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    size_t chunks() const {
+        return chunkCount;
+    }
+
+    // Newlines in chunk if the background count has reached it, else UNKNOWN
+    uint32_t newlinesIn(size_t chunk) const {
+        return newlineCounts[chunk].load(memory_order_acquire);
+    }
+
+    // Whether every chunk has been counted
+    bool scanned() const {
+        return finishedChunks.load(memory_order_acquire) == chunkCount;
+    }
+
+    // Words in the file as it was opened, once scanned() (chunks that could
+    // not be read are counted through the mapping here)
+    long long int words() const {
+        long long int total = 0;
+        for (size_t chunk = 0; chunk < chunkCount; ++chunk) {
+            if (newlinesIn(chunk) != UNKNOWN) {
+                total += wordCounts[chunk].load(memory_order_relaxed);
+                continue;
+            }
+            size_t start = chunk * CHUNK, end = min(length, start + CHUNK);
+            bool inWord = start > 0 && !isspace((unsigned char)base[start - 1]);
+            for (size_t i = start; i < end; ++i) {
+                bool space = isspace((unsigned char)base[i]);
+                total += !space && !inWord;
+                inWord = !space;
+            }
+        }
+        return total;
+    }
+};
+
+// A rope stores the whole document as a B-tree of gap buffer chunks. Every
+// node caches how many characters and newlines sit below it, so reaching a
+// character offset or the start of line N only walks one root-to-leaf path,
+// and an edit only touches one leaf plus the counters above it.
+//
+// A rope loaded from a MappedFile starts with one leaf per file chunk that
+// points into the mapping. Such a leaf is copied into a gap buffer the
+// first time an edit reaches it, and its newlines are counted the first
+// time a line lookup has to pass it, so opening costs nothing per byte and
+// line numbers only cost what lies before the line asked for. Counting is a
+// cache fill, so the const lookups are allowed to do it.
+//
+// Nodes are shared between copies of a rope, so copying one is O(1) and an
+// edit copies only the nodes on its path that another copy still holds.
+// A copy can be read on another thread while the original is edited; the
+// lazy counting only ever writes the newline fields, which readers of a
+// copy do not look at.
+class Rope {
+private:
+    static const size_t MAX_LEAF = 4096;    // Characters in a leaf before it splits
+    static const size_t MAX_CHILDREN = 16;  // Children of a node before it splits
+
+    struct RopeNode {
+        bool leaf = true;
+        bool counted = true;  // Whether every leaf below has had its newlines counted
+        size_t bytes = 0;     // Characters in this subtree
+        size_t newlines = 0;  // '\n' characters in the counted leaves of this subtree
+        GapBuffer text;                        // Contents, leaves only
+        const char* mapped = nullptr;          // Contents of a leaf still in the file mapping
+        size_t chunk = 0;                      // Which file chunk a mapped leaf holds
+        vector<shared_ptr<RopeNode>> children; // Subtrees, internal nodes only
+
+        char at(size_t i) const {
+            return mapped ? mapped[i] : text.at(i);
+        }
+
+        size_t count(char ch, size_t from, size_t to) const {
+            return mapped ? countIn(mapped + from, to - from, ch) : text.count(ch, from, to);
+        }
+
+        size_t findNth(char ch, size_t n) const {
+            return mapped ? findNthIn(mapped, bytes, ch, n) : text.findNth(ch, n);
+        }
+
+        void appendTo(string& out, size_t from, size_t to) const {
+            if (mapped) out.append(mapped + from, to - from);
+            else text.appendTo(out, from, to);
+        }
+    };
+    typedef vector<shared_ptr<RopeNode>> NodeList;
+
+    shared_ptr<RopeNode> root;
+    unsigned long long edits = 0;  // Bumped by every insert and erase
+    shared_ptr<MappedFile> file;   // Keeps the mapping alive while leaves point into it
+
+    static size_t countNewlines(const char* text, size_t len) {
+        return countIn(text, len, '\n');
+    }
+
+    static void recount(RopeNode* node) {
+        node->bytes = 0;
+        for (auto& child : node->children) node->bytes += child->bytes;
+        recountLines(node);
+    }
+
+    // Recount only the newline fields, for lookups that may run on shared nodes
+    static void recountLines(RopeNode* node) {
+        node->newlines = 0;
+        node->counted = true;
+        for (auto& child : node->children) {
+            node->newlines += child->newlines;
+            node->counted = node->counted && child->counted;
+        }
+    }
+
+    // Make node safe to edit: if another rope still holds it, replace it
+    // with a copy that shares its children
+    static RopeNode* own(shared_ptr<RopeNode>& node) {
+        if (node.use_count() > 1) node = make_shared<RopeNode>(*node);
+        return node.get();
+    }
+
+    // Cut an oversized leaf into half-full pieces; the extra pieces are returned
+    static NodeList splitLeaf(RopeNode* node) {
+        NodeList extra;
+        size_t total = node->text.size();
+        if (total <= MAX_LEAF) return extra;
+        size_t pieces = max<size_t>(2, total / (MAX_LEAF / 2));
+        // Split from the back so each cut only copies the piece it removes
+        for (size_t k = pieces - 1; k > 0; --k) {
+            size_t start = total * k / pieces;
+            shared_ptr<RopeNode> piece(new RopeNode());
+            piece->text = node->text.split(start);
+            piece->bytes = piece->text.size();
+            piece->newlines = piece->text.count('\n', 0, piece->bytes);
+            extra.push_back(move(piece));
+        }
+        reverse(extra.begin(), extra.end());
+        node->bytes = node->text.size();
+        node->newlines = node->text.count('\n', 0, node->bytes);
+        return extra;
+    }
+
+    // Regroup an overfull node's children into several nodes of the same depth
+    static NodeList splitInternal(RopeNode* node) {
+        NodeList extra;
+        size_t total = node->children.size();
+        if (total <= MAX_CHILDREN) return extra;
+        size_t groups = (total + MAX_CHILDREN - 1) / MAX_CHILDREN;
+        size_t groupSize = (total + groups - 1) / groups;
+        for (size_t start = groupSize; start < total; start += groupSize) {
+            shared_ptr<RopeNode> group(new RopeNode());
+            group->leaf = false;
+            for (size_t i = start; i < min(total, start + groupSize); ++i) {
+                group->children.push_back(move(node->children[i]));
+            }
+            recount(group.get());
+            extra.push_back(move(group));
+        }
+        node->children.resize(groupSize);
+        recount(node);
+        return extra;
+    }
+
+    // Count the newlines of a mapped leaf, using the background count if it got there first
+    void countLeaf(RopeNode* leaf) const {
+        if (leaf->counted) return;
+        uint32_t known = file->newlinesIn(leaf->chunk);
+        leaf->newlines = known != MappedFile::UNKNOWN ? known : leaf->count('\n', 0, leaf->bytes);
+        leaf->counted = true;
+    }
+
+    // Count every leaf of a subtree
+    void countAll(RopeNode* node) const {
+        if (node->counted) return;
+        if (node->leaf) {
+            countLeaf(node);
+            return;
+        }
+        for (auto& child : node->children) countAll(child.get());
+        recountLines(node);
+    }
+
+    // Find the start of the line remaining newlines into this subtree,
+    // counting leaves from the left only as far as needed. Returns true with
+    // offset advanced to the line start, or false with the whole subtree
+    // counted, passed and taken off remaining.
+    bool seekLine(RopeNode* node, size_t& remaining, size_t& offset) const {
+        if (node->leaf) {
+            countLeaf(node);
+            if (node->newlines >= remaining) {
+                offset += node->findNth('\n', remaining) + 1;
+                return true;
+            }
+            remaining -= node->newlines;
+            offset += node->bytes;
+            return false;
+        }
+        bool found = false;
+        for (auto& child : node->children) {
+            if (child->counted && child->newlines < remaining) {
+                remaining -= child->newlines;
+                offset += child->bytes;
+            } else if (seekLine(child.get(), remaining, offset)) {
+                found = true;
+                break;
+            }
+        }
+        if (!node->counted) recountLines(node);
+        return found;
+    }
+
+    // Number of newlines before offset pos in this subtree
+    size_t newlinesBefore(RopeNode* node, size_t pos) const {
+        if (node->leaf) return node->count('\n', 0, min(pos, node->bytes));
+        size_t line = 0;
+        for (size_t i = 0; i < node->children.size(); ++i) {
+            RopeNode* child = node->children[i].get();
+            if (pos >= child->bytes && i + 1 < node->children.size()) {
+                countAll(child);
+                line += child->newlines;
+                pos -= child->bytes;
+                continue;
+            }
+            line += newlinesBefore(child, pos);
+            break;
+        }
+        if (!node->counted) recountLines(node);
+        return line;
+    }
+
+    // Copy the mapped leaves an edit at [pos, pos + len) will reach into gap
+    // buffers, counting them first so the counters above stay exact. Follows
+    // the same path as insertAt (inserting) or eraseAt.
+    void materialize(RopeNode* node, size_t pos, size_t len, bool inserting) {
+        if (node->leaf) {
+            if (!node->mapped) return;
+            countLeaf(node);
+            node->text.insert(0, node->mapped, node->bytes);
+            node->mapped = nullptr;
+            return;
+        }
+        if (inserting) {
+            size_t i = 0;
+            while (i + 1 < node->children.size() && pos > node->children[i]->bytes) {
+                pos -= node->children[i]->bytes;
+                i++;
+            }
+            materialize(own(node->children[i]), pos, 0, true);
+        } else {
+            for (auto& child : node->children) {
+                if (len == 0) break;
+                if (pos >= child->bytes) {
+                    pos -= child->bytes;
+                    continue;
+                }
+                size_t take = min(len, child->bytes - pos);
+                materialize(own(child), pos, take, false);
+                len -= take;
+                pos = 0;
+            }
+        }
+        recount(node);
+    }
+
+    static NodeList insertAt(RopeNode* node, size_t pos, const char* text, size_t len, size_t newlines) {
+        node->bytes += len;
+        node->newlines += newlines;
+        if (node->leaf) {
+            node->text.insert(pos, text, len);
+            return splitLeaf(node);
+        }
+        size_t i = 0;
+        while (i + 1 < node->children.size() && pos > node->children[i]->bytes) {
+            pos -= node->children[i]->bytes;
+            i++;
+        }
+        NodeList extra = insertAt(own(node->children[i]), pos, text, len, newlines);
+        if (extra.empty()) return extra;
+        node->children.insert(node->children.begin() + i + 1,
+                              make_move_iterator(extra.begin()), make_move_iterator(extra.end()));
+        return splitInternal(node);
+    }
+
+    // Join neighbouring children that fit together in one node
+    static void mergeSmallChildren(RopeNode* node) {
+        auto& kids = node->children;
+        for (size_t i = 0; i + 1 < kids.size();) {
+            const RopeNode* b = kids[i + 1].get();
+            bool fits = b->leaf ? kids[i]->bytes + b->bytes <= MAX_LEAF / 2 && !kids[i]->mapped && !b->mapped
+                                : kids[i]->children.size() + b->children.size() <= MAX_CHILDREN / 2;
+            if (!fits) {
+                i++;
+                continue;
+            }
+            RopeNode* a = own(kids[i]);
+            if (a->leaf) {
+                a->text.append(b->text);
+            } else {
+                a->children.insert(a->children.end(), b->children.begin(), b->children.end());
+            }
+            a->bytes += b->bytes;
+            a->newlines += b->newlines;
+            a->counted = a->counted && b->counted;
+            kids.erase(kids.begin() + i + 1);
+        }
+    }
+
+    static void eraseAt(RopeNode* node, size_t pos, size_t len) {
+        if (node->leaf) {
+            size_t removed = node->text.count('\n', pos, pos + len);
+            node->text.erase(pos, len);
+            node->bytes -= len;
+            node->newlines -= removed;
+            return;
+        }
+        for (size_t i = 0; i < node->children.size() && len > 0; ++i) {
+            RopeNode* child = node->children[i].get();
+            if (pos >= child->bytes) {
+                pos -= child->bytes;
+                continue;
+            }
+            size_t take = min(len, child->bytes - pos);
+            eraseAt(own(node->children[i]), pos, take);
+            len -= take;
+            pos = 0;
+        }
+        auto& kids = node->children;
+        kids.erase(remove_if(kids.begin(), kids.end(),
+                             [](const shared_ptr<RopeNode>& child) { return child->bytes == 0; }),
+                   kids.end());
+        mergeSmallChildren(node);
+        recount(node);
+    }
+
+    // Group nodes under parents, a level at a time, until one root is left
+    static shared_ptr<RopeNode> buildTree(NodeList level) {
+        while (level.size() > 1) {
+            NodeList parents;
+            for (size_t i = 0; i < level.size(); i += MAX_CHILDREN) {
+                shared_ptr<RopeNode> parent(new RopeNode());
+                parent->leaf = false;
+                for (size_t j = i; j < min(level.size(), i + MAX_CHILDREN); ++j) {
+                    parent->children.push_back(move(level[j]));
+                }
+                recount(parent.get());
+                parents.push_back(move(parent));
+            }
+            level = move(parents);
+        }
+        return level.empty() ? make_shared<RopeNode>() : move(level[0]);
+    }
+
+    // Call visit(leaf) for every leaf, in order
+    template <typename Visitor>
+    static void forEachLeaf(const shared_ptr<RopeNode>& node, Visitor visit) {
+        if (node->leaf) {
+            visit(node);
+            return;
+        }
+        for (auto& child : node->children) forEachLeaf(child, visit);
+    }
+
+    // Visit the chunks from offset pos on; stops early once visit returns false
+    template <typename Visitor>
+    static bool visitFrom(const RopeNode* node, size_t pos, Visitor& visit) {
+        if (node->leaf) {
+            if (node->mapped) return pos >= node->bytes || visit(node->mapped + pos, node->bytes - pos);
+            auto front = node->text.front(), back = node->text.back();
+            if (pos < front.second && !visit(front.first + pos, front.second - pos)) return false;
+            pos = pos > front.second ? pos - front.second : 0;
+            return pos >= back.second || visit(back.first + pos, back.second - pos);
+        }
+        for (auto& child : node->children) {
+            if (pos >= child->bytes) {
+                pos -= child->bytes;
+                continue;
+            }
+            if (!visitFrom(child.get(), pos, visit)) return false;
+            pos = 0;
+        }
+        return true;
+    }
+
+    static void copyAt(const RopeNode* node, size_t pos, size_t len, string& out) {
+        if (node->leaf) {
+            node->appendTo(out, pos, pos + len);
+            return;
+        }
+        for (auto& child : node->children) {
+            if (len == 0) break;
+            if (pos >= child->bytes) {
+                pos -= child->bytes;
+                continue;
+            }
+            size_t take = min(len, child->bytes - pos);
+            copyAt(child.get(), pos, take, out);
+            len -= take;
+            pos = 0;
+        }
+    }
+
+public:
+    Rope() : root(new RopeNode()) {}
+
+    // Copies share every node with other until either side edits them
+    Rope(const Rope& other) : root(other.root), edits(other.edits), file(other.file) {}
+
+    Rope& operator=(const Rope& other) {
+        if (this != &other) {
+            root = other.root;
+            file = other.file;
+            edits++;
+        }
+        return *this;
+    }
+
+    // Replace the contents with a mapped file, one leaf per chunk, without
+    // reading any of it
+    void load(shared_ptr<MappedFile> source) {
+        NodeList level;
+        for (size_t chunk = 0; chunk < source->chunks(); ++chunk) {
+            shared_ptr<RopeNode> leaf(new RopeNode());
+            leaf->counted = false;
+            leaf->mapped = source->data() + chunk * MappedFile::CHUNK;
+            leaf->chunk = chunk;
+            leaf->bytes = min(MappedFile::CHUNK, source->size() - chunk * MappedFile::CHUNK);
+            level.push_back(move(leaf));
+        }
+        root = buildTree(move(level));
+        file = source;
+        edits++;
+    }
+
+    // Replace length characters at each of positions, which are ascending
+    // and do not overlap, with text. Leaves no match touches are kept as
+    // they are; the rest of the document is copied into fresh leaves in one
+    // pass, so the cost does not grow with the number of replacements.
+    void splice(const vector<size_t>& positions, size_t length, const string& text) {
+        if (positions.empty()) return;
+        NodeList leaves;
+        shared_ptr<RopeNode> leaf;   // Fresh leaf being filled
+        auto append = [&](const char* data, size_t len) {
+            while (len > 0) {
+                if (!leaf || leaf->bytes >= MAX_LEAF * 3 / 4) {  // Leave room for typing
+                    leaf = make_shared<RopeNode>();
+                    leaves.push_back(leaf);
+                }
+                size_t take = min(len, MAX_LEAF * 3 / 4 - leaf->bytes);
+                leaf->text.insert(leaf->bytes, data, take);
+                leaf->bytes += take;
+                leaf->newlines += countNewlines(data, take);
+                data += take;
+                len -= take;
+            }
+        };
+        size_t offset = 0, next = 0, skipTo = 0;
+        bool keepsMapping = false;
+        auto copyChunk = [&](const char* data, size_t len) {
+            size_t i = 0;
+            while (i < len) {
+                size_t at = offset + i;
+                if (at < skipTo) {
+                    i += min(len - i, skipTo - at);
+                } else if (next < positions.size() && positions[next] == at) {
+                    append(text.data(), text.size());
+                    skipTo = at + length;
+                    next++;
+                } else {
+                    size_t stop = next < positions.size() ? min(len, positions[next] - offset) : len;
+                    append(data + i, stop - i);
+                    i = stop;
+                }
+            }
+            offset += len;
+            return true;
+        };
+        forEachLeaf(root, [&](const shared_ptr<RopeNode>& node) {
+            size_t end = offset + node->bytes;
+            if (skipTo <= offset && (next == positions.size() || positions[next] >= end)) {
+                leaves.push_back(node);
+                leaf.reset();
+                keepsMapping |= node->mapped != nullptr;
+                offset = end;
+            } else {
+                visitFrom(node.get(), 0, copyChunk);
+            }
+        });
+        if (next < positions.size()) append(text.data(), text.size());  // Only an empty match can sit at the end
+        root = buildTree(move(leaves));
+        if (!keepsMapping) file.reset();  // Nothing points into the mapping any more
+        edits++;
+    }
+
+    // Changes whenever the text does, so callers can tell in O(1) whether
+    // anything they derived from the document is out of date
+    unsigned long long version() const {
+        return edits;
+    }
+
+    size_t size() const {
+        return root->bytes;
+    }
+
+    // Counts the whole document if it was loaded from a file and not yet counted
+    size_t lineCount() const {
+        countAll(root.get());
+        return root->newlines + 1;
+    }
+
+    // Whether line (0-based) exists; only counts as far as that line
+    bool hasLine(size_t line) const {
+        if (line == 0) return true;
+        size_t remaining = line, offset = 0;
+        return seekLine(root.get(), remaining, offset);
+    }
+
+    // Insert len characters before offset pos
+    void insert(size_t pos, const char* text, size_t len) {
+        if (len == 0) return;
+        edits++;
+        materialize(own(root), pos, 0, true);
+        NodeList extra = insertAt(own(root), pos, text, len, countNewlines(text, len));
+        // The root split: grow the tree by one level
+        while (!extra.empty()) {
+            shared_ptr<RopeNode> newRoot(new RopeNode());
+            newRoot->leaf = false;
+            newRoot->children.push_back(move(root));
+            for (auto& node : extra) newRoot->children.push_back(move(node));
+            extra = splitInternal(newRoot.get());
+            recount(newRoot.get());
+            root = move(newRoot);
+        }
+    }
+
+    void insert(size_t pos, char ch) {
+        insert(pos, &ch, 1);
+    }
+
+    // Remove len characters starting at offset pos
+    void erase(size_t pos, size_t len) {
+        if (len == 0) return;
+        edits++;
+        materialize(own(root), pos, len, false);
+        eraseAt(own(root), pos, len);
+        // Drop levels that only have a single child left
+        while (!root->leaf && root->children.size() == 1) {
+            shared_ptr<RopeNode> child = root->children[0];
+            root = move(child);
+        }
+        if (!root->leaf && root->children.empty()) root.reset(new RopeNode());
+    }
+
+    // Character at offset pos
+    char charAt(size_t pos) const {
+        const RopeNode* node = root.get();
+        while (!node->leaf) {
+            size_t i = 0;
+            while (pos >= node->children[i]->bytes) {
+                pos -= node->children[i]->bytes;
+                i++;
+            }
+            node = node->children[i].get();
+        }
+        return node->at(pos);
+    }
+
+    // Offset of the first character of line (0-based)
+    size_t lineStart(size_t line) const {
+        if (line == 0) return 0;
+        if (root->counted && line > root->newlines) return size();
+        size_t remaining = line;   // Newlines still to pass
+        size_t offset = 0;
+        return seekLine(root.get(), remaining, offset) ? offset : size();
+    }
+
+    // Line (0-based) that offset pos belongs to
+    size_t lineOf(size_t pos) const {
+        return newlinesBefore(root.get(), pos);
+    }
+
+    // Number of characters in line, not counting its newline
+    size_t lineLength(size_t line) const {
+        size_t end = hasLine(line + 1) ? lineStart(line + 1) - 1 : size();
+        return end - lineStart(line);
+    }
+
+    // Append len characters starting at offset pos onto out
+    void copy(size_t pos, size_t len, string& out) const {
+        copyAt(root.get(), pos, min(len, size() - pos), out);
+    }
+
+    // Copies stretches of a rope at ascending offsets, keeping the leaf it
+    // last read so nearby stretches need no walk down from the root
+    class Reader {
+    private:
+        const Rope& rope;
+        const RopeNode* leaf = nullptr;
+        size_t leafStart = 0;
+
+    public:
+        explicit Reader(const Rope& rope) : rope(rope) {}
+
+        void copy(size_t pos, size_t len, string& out) {
+            if (!leaf || pos < leafStart || pos >= leafStart + leaf->bytes) {
+                leaf = rope.root.get();
+                leafStart = 0;
+                while (!leaf->leaf) {
+                    size_t i = 0;
+                    while (i + 1 < leaf->children.size() && pos - leafStart >= leaf->children[i]->bytes) {
+                        leafStart += leaf->children[i++]->bytes;
+                    }
+                    leaf = leaf->children[i].get();
+                }
+            }
+            size_t from = pos - leafStart;
+            if (from + len <= leaf->bytes) leaf->appendTo(out, from, from + len);
+            else rope.copy(pos, len, out);
+        }
+    };
+
+    // Call visit(data, len) for every contiguous chunk of text, in order
+    template <typename Visitor>
+    void forEachChunk(Visitor visit) const {
+        vector<const RopeNode*> pending = {root.get()};
+        while (!pending.empty()) {
+            const RopeNode* node = pending.back();
+            pending.pop_back();
+            if (node->leaf) {
+                if (node->mapped) {
+                    visit(node->mapped, node->bytes);
+                    continue;
+                }
+                if (node->text.front().second) visit(node->text.front().first, node->text.front().second);
+                if (node->text.back().second) visit(node->text.back().first, node->text.back().second);
+                continue;
+            }
+            for (size_t i = node->children.size(); i-- > 0;) pending.push_back(node->children[i].get());
+        }
+    }
+
+    // Call visit(data, len) for every contiguous chunk of text from offset
+    // pos on, in order, until visit returns false
+    template <typename Visitor>
+    void forEachChunkFrom(size_t pos, Visitor visit) const {
+        visitFrom(root.get(), pos, visit);
+    }
+
+    string toString() const {
+        string out;
+        out.reserve(size());
+        forEachChunk([&out](const char* text, size_t len) { out.append(text, len); });
+        return out;
+    }
+
+};
+
+// Write every iovec in batch, resuming after short writes
+bool writeAll(int fd, vector<iovec>& batch) {
+    size_t first = 0;
+    while (first < batch.size()) {
+        int count = min<size_t>(batch.size() - first, IOV_MAX);
+        ssize_t written = writev(fd, &batch[first], count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        // Skip the iovecs that were written completely and trim the next one
+        while (first < batch.size() && (size_t)written >= batch[first].iov_len) {
+            written -= batch[first].iov_len;
+            first++;
+        }
+        if (first < batch.size()) {
+            batch[first].iov_base = (char*)batch[first].iov_base + written;
+            batch[first].iov_len -= written;
+        }
+    }
+    batch.clear();
+    return true;
+}
+
+// Save text followed by trailer to path. The rope's chunks go straight to
+// writev() in large batches into path.tmp, which is synced and then renamed
+// over path, so a crash leaves either the old file or the new one. The
+// directory is synced last so the rename itself is on disk. synced, if
+// given, is called with the finished file's stat just before the rename,
+// which only goes ahead if it returns true.
+bool writeDocument(const Rope& text, const string& path, const string& trailer,
+                   const function<bool(const struct stat&)>& synced = nullptr) {
+    string temp = path + ".tmp";
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    struct stat original;
+    if (stat(path.c_str(), &original) == 0) fchmod(fd, original.st_mode & 07777);  // Keep the file's permissions
+
+    vector<iovec> batch;
+    size_t batchBytes = 0;
+    bool ok = true;
+    text.forEachChunk([&](const char* data, size_t len) {
+        if (!ok) return;
+        batch.push_back({(void*)data, len});
+        batchBytes += len;
+        if (batchBytes >= SAVE_BATCH_BYTES) {
+            ok = writeAll(fd, batch);
+            batchBytes = 0;
+        }
+    });
+    if (ok && !trailer.empty()) batch.push_back({(void*)trailer.data(), trailer.size()});
+    ok = ok && writeAll(fd, batch) && fsync(fd) == 0;
+    struct stat written;
+    ok = ok && fstat(fd, &written) == 0;
+    ok = close(fd) == 0 && ok;
+    if (ok && synced) ok = synced(written);
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+        unlink(temp.c_str());
+        return false;
+    }
+
+    size_t slash = path.rfind('/');
+    string directory = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int dirFd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    return true;
+}
+
+// Writes documents on a thread of its own so saving never holds up typing.
+// The editor hands over a copy of the rope, which costs O(1) and stays
+// unchanged however the document is edited meanwhile. A save asked for
+// while another is being written replaces any save still waiting, since
+// only the newest text matters.
+class BackgroundSaver {
+public:
+    struct Result {
+        unsigned long long generation;  // What the caller passed to save()
+        uint64_t marker;                // Likewise
+        bool ok;
+    };
+
+private:
+    struct Request {
+        Rope text;
+        string path, trailer;
+        unsigned long long generation;
+        uint64_t marker;
+        function<bool(const struct stat&)> synced;
+    };
+
+    mutex lock;
+    condition_variable wake, idle;
+    bool writing = false;
+    bool stopping = false;
+    deque<Request> requests;      // Saves to write, at most one per path
+    deque<Result> finished;       // Saves written since the editor last looked
+    int editorWake[2];            // Pipe the editor polls for finished saves
+    thread worker;
+
+    void run() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [this] { return !requests.empty() || stopping; });
+            if (requests.empty()) break;   // Stopping with nothing left to write
+            Request next = move(requests.front());
+            requests.pop_front();
+            writing = true;
+            guard.unlock();
+            Result result = {next.generation, next.marker, writeDocument(next.text, next.path, next.trailer, next.synced)};
+            next = Request();         // Let go of the snapshot before reporting
+            guard.lock();
+            writing = false;
+            if (requests.empty()) idle.notify_all();
+            finished.push_back(result);
+            char byte = 1;
+            ssize_t ignored = ::write(editorWake[1], &byte, 1);
+            (void)ignored;
+        }
+    }
+
+public:
+    BackgroundSaver() {
+        if (pipe(editorWake) != 0) {
+            cout << "Could not start the saver" << endl;
+            exit(1);
+        }
+        for (int fd : editorWake) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        worker = thread(&BackgroundSaver::run, this);
+    }
+
+    BackgroundSaver(const BackgroundSaver&) = delete;
+    BackgroundSaver& operator=(const BackgroundSaver&) = delete;
+
+    // Finish the save still waiting, if any, then stop
+    ~BackgroundSaver() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+        for (int fd : editorWake) close(fd);
+    }
+
+    // Queue text to be written to path, followed by trailer. generation and
+    // marker come back in the Result; synced is passed to writeDocument().
+    void save(const Rope& text, const string& path, const string& trailer, unsigned long long generation,
+              uint64_t marker = 0, function<bool(const struct stat&)> synced = nullptr) {
+        {
+            lock_guard<mutex> guard(lock);
+            Request request = {text, path, trailer, generation, marker, move(synced)};
+            auto queued = find_if(requests.begin(), requests.end(), [&](const Request& r) { return r.path == path; });
+            if (queued != requests.end()) *queued = move(request);
+            else requests.push_back(move(request));
+        }
+        wake.notify_one();
+    }
+
+    // Wait until every queued save has been written
+    void finish() {
+        unique_lock<mutex> guard(lock);
+        idle.wait(guard, [this] { return requests.empty() && !writing; });
+    }
+
+    // Readable when a save has finished
+    int resultFd() const {
+        return editorWake[0];
+    }
+
+    // Take the next finished save, if any
+    bool nextResult(Result& result) {
+        char bytes[64];
+        while (read(editorWake[0], bytes, sizeof(bytes)) > 0) {}
+        lock_guard<mutex> guard(lock);
+        if (finished.empty()) return false;
+        result = finished.front();
+        finished.pop_front();
+        return true;
+    }
+};
+
+// Find and Replace
+
+struct SearchOptions {
+    bool ignoreCase = true;
+    bool wholeWord = false;   // Only matches with no letter or digit on either side
+};
+
+// Finds a pattern in a rope without copying the document. Each contiguous
+// chunk is scanned where it lies: SSE2 tests 16 starting positions at once
+// against the pattern's first and last bytes, and only positions where
+// both agree are compared in full. A match running across a chunk boundary
+// is found in a small buffer holding the bytes either side of it.
+class TextSearch {
+private:
+    string pattern;        // Lowercase when ignoring case
+    SearchOptions options;
+
+    static unsigned char lower(unsigned char c) {
+        return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    }
+
+    bool matchesAt(const char* text) const {
+        if (!options.ignoreCase) return memcmp(text, pattern.data(), pattern.size()) == 0;
+        for (size_t i = 0; i < pattern.size(); ++i) {
+            if (lower(text[i]) != (unsigned char)pattern[i]) return false;
+        }
+        return true;
+    }
+
+    // Start of the first match lying wholly inside text[0, len) at or after
+    // from, or len if there is none
+    size_t scan(const char* text, size_t len, size_t from) const {
+        size_t m = pattern.size();
+        if (len < m) return len;
+        size_t last = len - m;   // Last possible start
+        size_t i = from;
+#ifdef __SSE2__
+        // Letters are compared with bit 0x20 set, which makes them lowercase;
+        // other bytes it changes only add candidates that fail matchesAt()
+        bool foldFirst = options.ignoreCase && isalpha((unsigned char)pattern[0]);
+        bool foldLast = options.ignoreCase && isalpha((unsigned char)pattern[m - 1]);
+        const __m128i first = _mm_set1_epi8(pattern[0]);
+        const __m128i final = _mm_set1_epi8(pattern[m - 1]);
+        const __m128i caseBit = _mm_set1_epi8(0x20);
+        for (; i + 16 <= last + 1; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(text + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(text + i + m - 1));
+            if (foldFirst) a = _mm_or_si128(a, caseBit);
+            if (foldLast) b = _mm_or_si128(b, caseBit);
+            unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, final)));
+            while (mask) {
+                unsigned bit = __builtin_ctz(mask);
+                if (matchesAt(text + i + bit)) return i + bit;
+                mask &= mask - 1;
+            }
+        }
+#endif
+        for (; i <= last; ++i) {
+            if ((options.ignoreCase ? lower(text[i]) : (unsigned char)text[i]) == (unsigned char)pattern[0]
+                && matchesAt(text + i)) return i;
+        }
+        return len;
+    }
+
+    static bool isWordChar(char c) {
+        return isalnum((unsigned char)c) != 0;
+    }
+
+    // Whole-word check for a match at text[i], document offset pos, within
+    // data[0, len); the rope is only read when a neighbour lies outside it
+    bool acceptable(const Rope& text, size_t pos, const char* data, size_t i, size_t len) const {
+        if (!options.wholeWord) return true;
+        size_t m = pattern.size();
+        char before = i > 0 ? data[i - 1] : pos > 0 ? text.charAt(pos - 1) : ' ';
+        char after = i + m < len ? data[i + m] : pos + m < text.size() ? text.charAt(pos + m) : ' ';
+        return !isWordChar(before) && !isWordChar(after);
+    }
+
+public:
+    TextSearch(const string& query, SearchOptions options) : pattern(query), options(options) {
+        if (options.ignoreCase) transform(pattern.begin(), pattern.end(), pattern.begin(), lower);
+    }
+
+    size_t length() const {
+        return pattern.size();
+    }
+
+    // Call visit(pos) for every match starting at or after from, in order,
+    // until visit returns false. Matches may overlap.
+    template <typename Visitor>
+    void forEachMatch(const Rope& text, size_t from, Visitor visit) const {
+        size_t m = pattern.size();
+        if (m == 0) return;
+        string carry;           // Up to m - 1 bytes before the current chunk
+        size_t offset = from;   // Document offset of the current chunk
+        string joint;
+        text.forEachChunkFrom(from, [&](const char* data, size_t len) {
+            // Matches that start in carry and end in this chunk
+            if (!carry.empty()) {
+                joint.assign(carry);
+                joint.append(data, min(len, m));   // One more for the whole-word check
+                size_t carryStart = offset - carry.size();
+                for (size_t i = 0; i < carry.size();) {
+                    i = scan(joint.data(), joint.size(), i);
+                    if (i >= carry.size()) break;
+                    if (acceptable(text, carryStart + i, joint.data(), i, joint.size()) && !visit(carryStart + i)) return false;
+                    i++;
+                }
+            }
+            for (size_t i = 0;;) {
+                i = scan(data, len, i);
+                if (i >= len) break;
+                if (acceptable(text, offset + i, data, i, len) && !visit(offset + i)) return false;
+                i++;
+            }
+            // Keep the last m - 1 bytes for the next boundary
+            if (len >= m - 1) {
+                carry.assign(data + len - (m - 1), m - 1);
+            } else {
+                carry.append(data, len);
+                if (carry.size() > m - 1) carry.erase(0, carry.size() - (m - 1));
+            }
+            offset += len;
+            return true;
+        });
+    }
+
+    // First match at or after from, wrapping round to the start of the
+    // document; string::npos if there is none
+    size_t next(const Rope& text, size_t from) const {
+        size_t found = string::npos;
+        auto take = [&found](size_t pos) {
+            found = pos;
+            return false;
+        };
+        forEachMatch(text, from, take);
+        if (found == string::npos && from > 0) forEachMatch(text, 0, take);
+        return found;
+    }
+
+    // Every match that does not overlap an earlier one, in order
+    vector<size_t> all(const Rope& text) const {
+        vector<size_t> found;
+        forEachMatch(text, 0, [&](size_t pos) {
+            if (found.empty() || pos >= found.back() + pattern.size()) found.push_back(pos);
+            return true;
+        });
+        return found;
+    }
+};
+
+// Undo History
+
+// One reversible change to the document
+struct EditOp {
+    bool inserted;   // true if text was inserted at pos, false if it was removed from pos
+    size_t pos;
+    string text;
+};
+
+// Edits that are undone and redone together, e.g. one typed word
+struct UndoGroup {
+    vector<EditOp> ops;
+    size_t cursorBefore = 0;  // Cursor offset before the first edit
+    size_t cursorAfter = 0;   // Cursor offset after the last edit
+    size_t bytes = 0;         // Text held by ops
+    unsigned long long generation = 0; // Identifies the document state after this group
+};
+
+// The undo history is a log of the edits themselves rather than copies of
+// the document, so its memory grows with the amount of text edited and an
+// undo or redo only costs as much as the edit it reverses.
+class UndoJournal {
+private:
+    deque<UndoGroup> undoStack;  // Oldest group at the front
+    vector<UndoGroup> redoStack;
+    size_t totalBytes = 0;       // Text held by both stacks
+    bool groupOpen = false;      // Whether the next edit joins undoStack.back()
+    unsigned long long nextGeneration = 1;
+    unsigned long long baseGeneration = 0; // State below the oldest group kept
+
+    void clearRedo() {
+        for (auto& group : redoStack) totalBytes -= group.bytes;
+        redoStack.clear();
+    }
+
+    // Drop the oldest groups once the history is over its byte budget
+    void trim() {
+        while (totalBytes > MAX_UNDO_BYTES && undoStack.size() > 1) {
+            totalBytes -= undoStack.front().bytes;
+            baseGeneration = undoStack.front().generation;
+            undoStack.pop_front();
+        }
+    }
+
+public:
+    // Record an edit that has just been applied to the document
+    void record(bool inserted, size_t pos, const char* text, size_t len, size_t cursorBefore, size_t cursorAfter) {
+        StageTimer timer(STAGE_UNDO);
+        clearRedo(); // A new edit makes the undone edits unreachable
+        if (!groupOpen || undoStack.empty()) {
+            undoStack.emplace_back();
+            undoStack.back().cursorBefore = cursorBefore;
+            undoStack.back().generation = nextGeneration++;
+            groupOpen = true;
+        }
+        UndoGroup& group = undoStack.back();
+        EditOp* last = group.ops.empty() ? nullptr : &group.ops.back();
+
+        // Extend the previous edit when this one continues it
+        if (last && inserted && last->inserted && pos == last->pos + last->text.size()) {
+            last->text.append(text, len);                    // Typing
+        } else if (last && !inserted && !last->inserted && pos + len == last->pos) {
+            last->text.insert(0, text, len);                 // Backspace
+            last->pos = pos;
+        } else if (last && !inserted && !last->inserted && pos == last->pos) {
+            last->text.append(text, len);                    // Delete key
+        } else {
+            group.ops.push_back({inserted, pos, string(text, len)});
+        }
+        group.cursorAfter = cursorAfter;
+        group.bytes += len;
+        totalBytes += len;
+        trim();
+    }
+
+    // End the current group so the next edit starts a new undo step
+    void closeGroup() {
+        groupOpen = false;
+    }
+
+    // Text held for undo and redo, in bytes
+    size_t bytes() const {
+        return totalBytes;
+    }
+
+    // Names the current document state. Two equal generations mean the same
+    // text, even when undo and redo were used to get back to it.
+    unsigned long long generation() const {
+        return undoStack.empty() ? baseGeneration : undoStack.back().generation;
+    }
+
+    // Reverse the newest group through apply(op, forward); cursor receives
+    // where the cursor belongs afterwards
+    template <typename Apply>
+    bool undo(Apply apply, size_t& cursor) {
+        if (undoStack.empty()) return false;
+        UndoGroup group = move(undoStack.back());
+        undoStack.pop_back();
+        for (size_t i = group.ops.size(); i-- > 0;) apply(group.ops[i], false);
+        cursor = group.cursorBefore;
+        redoStack.push_back(move(group));
+        groupOpen = false;
+        return true;
+    }
+
+    // Re-apply the most recently undone group
+    template <typename Apply>
+    bool redo(Apply apply, size_t& cursor) {
+        if (redoStack.empty()) return false;
+        UndoGroup group = move(redoStack.back());
+        redoStack.pop_back();
+        for (auto& op : group.ops) apply(op, true);
+        cursor = group.cursorAfter;
+        undoStack.push_back(move(group));
+        groupOpen = false;
+        return true;
+    }
+};
+
+// Identifies one version of a file: a rename keeps all three, rewriting
+// the file changes its size or modification time
+struct FileIdentity {
+    uint64_t inode = 0, size = 0;
+    int64_t modified = 0;
+
+    static FileIdentity of(const struct stat& info) {
+        FileIdentity id;
+        id.inode = info.st_ino;
+        id.size = info.st_size;
+        id.modified = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+        return id;
+    }
+
+    bool operator==(const FileIdentity& other) const {
+        return inode == other.inode && size == other.size && modified == other.modified;
+    }
+};
+
+// Crash-recovery journal, kept next to the edited file as <file>.journal.
+// Every edit is appended as a small checksummed record. Records collect in
+// memory and a writer thread writes and fdatasync()s them together every
+// JOURNAL_SYNC_MS, so an edit costs a copy into a buffer and a crash loses
+// at most that much typing.
+//
+// The journal opens with a checkpoint record naming the text it applies
+// to: the empty document, the edited file or <file>.checkpoint, the files
+// by identity. When a copy of the document is written out, mark() puts a
+// marker where the copy was taken, and checkpointed() syncs a checkpoint
+// record for that marker before the copy is renamed into place. Recovery
+// starts from the newest checkpoint whose file is still on disk unchanged
+// and replays the edits after its marker. Once the copy is in place,
+// compact() rewrites the journal to start from it, which keeps the journal
+// about as long as the edits since the last save or checkpoint.
+//
+// A failed write or sync leaves the file in an unknown state past the
+// durable bytes, so the journal stops writing for good: later edits are
+// dropped, checkpointed() reports failure and intact() turns false.
+class EditJournal {
+public:
+    enum Base : uint8_t { BASE_EMPTY, BASE_FILE, BASE_CHECKPOINT };
+
+    // What recover() found: the text to start from and the edits to replay
+    struct Recovered {
+        Base base = BASE_EMPTY;
+        vector<EditOp> edits;
+        uint64_t validBytes = 0;  // Length of the journal up to its last intact record
+        uint64_t nextMarker = 1;
+    };
+
+private:
+    static constexpr char MAGIC[9] = "TXJRNL1\n";
+    static const size_t MAGIC_SIZE = 8;
+    enum Record : uint8_t { INSERT = 'I', ERASE = 'E', MARKER = 'M', CHECKPOINT = 'C' };
+
+    string filePath;
+    int fd = -1;
+    mutex lock;
+    condition_variable wake, synced;
+    string buffer;              // Records not yet written
+    uint64_t appended = 0;      // Journal bytes so far, written or not
+    uint64_t durable = 0;       // Journal bytes known to be on disk
+    bool failed = false;        // A write or sync failed; durable no longer advances
+    uint64_t dropped = 0;       // Bytes compaction removed from the front
+    bool syncWanted = false;
+    uint64_t compactWanted = 0; // Marker to compact to, 0 for none
+    uint64_t baseMarker = 0;    // Marker of the checkpoint the file starts with
+    uint64_t nextMarker = 1;
+    map<uint64_t, uint64_t> markerEnds;   // Marker -> journal offset just past its record
+    map<uint64_t, string> checkpoints;    // Marker -> its synced checkpoint record
+    bool stopping = false;
+    thread writer;
+
+    static uint32_t checksum(const char* data, size_t len) {
+        uint32_t hash = 2166136261u;   // FNV-1a
+        for (size_t i = 0; i < len; ++i) hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+        return hash;
+    }
+
+    template <typename T>
+    static void put(string& out, T value) {
+        out.append((const char*)&value, sizeof(value));
+    }
+
+    template <typename T>
+    static bool take(const char*& data, const char* end, T& value) {
+        if ((size_t)(end - data) < sizeof(value)) return false;
+        memcpy(&value, data, sizeof(value));
+        data += sizeof(value);
+        return true;
+    }
+
+    // Type, body length, body and a checksum of all three
+    static string encode(Record type, const string& body) {
+        string record;
+        put<uint8_t>(record, type);
+        put<uint32_t>(record, body.size());
+        record += body;
+        put<uint32_t>(record, checksum(record.data(), record.size()));
+        return record;
+    }
+
+    static string checkpointRecord(uint64_t marker, Base base, const FileIdentity& id) {
+        string body;
+        put(body, marker);
+        put<uint8_t>(body, base);
+        put(body, id.inode);
+        put(body, id.size);
+        put(body, id.modified);
+        return encode(CHECKPOINT, body);
+    }
+
+    static bool currentIdentity(const string& path, FileIdentity& id) {
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0) return false;
+        id = FileIdentity::of(info);
+        return true;
+    }
+
+    static bool syncDirectory(const string& path) {
+        size_t slash = path.rfind('/');
+        string directory = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        int dirFd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirFd < 0) return false;
+        bool ok = fsync(dirFd) == 0;
+        ::close(dirFd);
+        return ok;
+    }
+
+    static bool writeFully(int fd, const char* data, size_t len) {
+        while (len > 0) {
+            ssize_t n = ::write(fd, data, len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            data += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    // Replace the journal with one that starts at the checkpoint for marker.
+    // Runs on the writer thread with everything appended so far written.
+    void compactTo(uint64_t marker, uint64_t end) {
+        string header, tail;
+        uint64_t start;
+        {
+            lock_guard<mutex> guard(lock);
+            if (marker <= baseMarker || !checkpoints.count(marker) || !markerEnds.count(marker)) return;
+            header = string(MAGIC, MAGIC_SIZE) + checkpoints[marker];
+            start = markerEnds[marker];
+        }
+        tail.resize(end - start);
+        size_t got = 0;
+        while (got < tail.size()) {
+            ssize_t n = pread(fd, &tail[got], tail.size() - got, start - dropped + got);
+            if (n <= 0) return;
+            got += n;
+        }
+        string path = journalPath(filePath), temp = path + ".tmp";
+        int newFd = ::open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (newFd < 0) return;
+        if (!writeFully(newFd, header.data(), header.size()) || !writeFully(newFd, tail.data(), tail.size())
+            || fsync(newFd) != 0 || rename(temp.c_str(), path.c_str()) != 0) {
+            ::close(newFd);
+            unlink(temp.c_str());
+            return;
+        }
+        syncDirectory(path);
+        ::close(fd);
+        fd = newFd;
+        lseek(fd, 0, SEEK_END);
+
+        lock_guard<mutex> guard(lock);
+        dropped = start - header.size();
+        baseMarker = marker;
+        markerEnds.erase(markerEnds.begin(), markerEnds.upper_bound(marker));
+        checkpoints.erase(checkpoints.begin(), checkpoints.upper_bound(marker));
+    }
+
+    // Group commit: write and sync whatever has collected, every
+    // JOURNAL_SYNC_MS or sooner when someone waits for it
+    void run() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait_for(guard, chrono::milliseconds(JOURNAL_SYNC_MS),
+                          [this] { return stopping || syncWanted || compactWanted; });
+            string batch;
+            batch.swap(buffer);
+            uint64_t end = appended;
+            uint64_t compact = compactWanted;
+            syncWanted = false;
+            compactWanted = 0;
+            bool last = stopping;
+            bool ok = !failed;
+            guard.unlock();
+            if (ok && !batch.empty()) ok = writeFully(fd, batch.data(), batch.size()) && fdatasync(fd) == 0;
+            if (ok && compact) compactTo(compact, end);
+            guard.lock();
+            if (ok) durable = end;
+            else failed = true;
+            synced.notify_all();
+            if (last) break;
+        }
+    }
+
+    void append(const string& record) {
+        lock_guard<mutex> guard(lock);
+        buffer += record;
+        appended += record.size();
+    }
+
+    EditJournal(const string& filePath) : filePath(filePath) {}
+
+public:
+    static string journalPath(const string& filePath) {
+        return filePath + ".journal";
+    }
+
+    static string checkpointPath(const string& filePath) {
+        return filePath + ".checkpoint";
+    }
+
+    // Read the journal a crashed session left for filePath. Returns false if
+    // there is none, or if none of the files it could start from is still
+    // as it was.
+    static bool recover(const string& filePath, Recovered& found) {
+        ifstream in(journalPath(filePath), ios::binary);
+        if (!in) return false;
+        string contents((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        if (contents.compare(0, MAGIC_SIZE, MAGIC, MAGIC_SIZE) != 0) return false;
+
+        struct Entry {
+            Record type;
+            uint64_t marker;
+            EditOp op;
+        };
+        vector<Entry> entries;
+        int start = -1;          // Replay the entries after this one
+        bool haveBase = false;
+        uint64_t baseMarker = 0;
+        uint64_t maxMarker = 0;
+        FileIdentity fileId, checkpointId;
+        bool fileExists = currentIdentity(filePath, fileId);
+        bool checkpointExists = currentIdentity(checkpointPath(filePath), checkpointId);
+
+        const char* data = contents.data() + MAGIC_SIZE;
+        const char* end = contents.data() + contents.size();
+        found.validBytes = MAGIC_SIZE;
+        while (data < end) {
+            const char* record = data;
+            uint8_t type;
+            uint32_t length, sum;
+            if (!take(data, end, type) || !take(data, end, length) || (size_t)(end - data) < length) break;
+            const char* body = data;
+            data += length;
+            if (!take(data, end, sum) || sum != checksum(record, data - record - sizeof(sum))) break;  // Torn write
+
+            Entry entry = {(Record)type, 0, {false, 0, ""}};
+            const char* bodyEnd = body + length;
+            if (type == INSERT || type == ERASE) {
+                uint64_t pos;
+                if (!take(body, bodyEnd, pos)) break;
+                entry.op = {type == INSERT, pos, string(body, bodyEnd)};
+            } else if (type == MARKER) {
+                if (!take(body, bodyEnd, entry.marker)) break;
+            } else if (type == CHECKPOINT) {
+                uint8_t base;
+                FileIdentity id;
+                if (!take(body, bodyEnd, entry.marker) || !take(body, bodyEnd, base) || !take(body, bodyEnd, id.inode)
+                    || !take(body, bodyEnd, id.size) || !take(body, bodyEnd, id.modified)) break;
+                bool usable = base == BASE_EMPTY || (base == BASE_FILE && fileExists && id == fileId)
+                           || (base == BASE_CHECKPOINT && checkpointExists && id == checkpointId);
+                // A compacted journal starts with a copy of its checkpoint
+                // record, which then comes again further on
+                if (usable && !(haveBase && entry.marker == baseMarker)) {
+                    // Start after the snapshot's marker, or here when it was compacted away
+                    found.base = (Base)base;
+                    haveBase = true;
+                    baseMarker = entry.marker;
+                    start = entries.size();
+                    for (size_t i = entries.size(); i-- > 0;) {
+                        if (entries[i].type == MARKER && entries[i].marker == entry.marker) {
+                            start = i;
+                            break;
+                        }
+                    }
+                }
+            } else {
+                break;
+            }
+            maxMarker = max(maxMarker, entry.marker);
+            entries.push_back(move(entry));
+            found.validBytes = data - contents.data();
+        }
+        if (!haveBase) return false;
+
+        found.nextMarker = maxMarker + 1;
+        found.edits.clear();
+        for (size_t i = start + 1; i < entries.size(); ++i) {
+            if (entries[i].type == INSERT || entries[i].type == ERASE) found.edits.push_back(move(entries[i].op));
+        }
+        return true;
+    }
+
+    // Journal edits to filePath's document. With validBytes 0 a new journal
+    // is started from base; otherwise the recovered journal is kept, cut
+    // after its last intact record, and appended to.
+    static unique_ptr<EditJournal> open(const string& filePath, const Recovered& recovered, Base base) {
+        unique_ptr<EditJournal> journal(new EditJournal(filePath));
+        string path = journalPath(filePath);
+        if (recovered.validBytes == 0) {
+            FileIdentity id;
+            if (base == BASE_FILE && !currentIdentity(filePath, id)) return nullptr;
+            string header = string(MAGIC, MAGIC_SIZE) + checkpointRecord(0, base, id);
+            string temp = path + ".tmp";
+            int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (fd < 0) return nullptr;
+            bool ok = writeFully(fd, header.data(), header.size()) && fsync(fd) == 0;
+            ok = ::close(fd) == 0 && ok;
+            if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+                unlink(temp.c_str());
+                return nullptr;
+            }
+            syncDirectory(path);
+            journal->appended = journal->durable = header.size();
+        } else {
+            if (truncate(path.c_str(), recovered.validBytes) != 0) return nullptr;
+            journal->appended = journal->durable = recovered.validBytes;
+            journal->nextMarker = recovered.nextMarker;
+        }
+        journal->fd = ::open(path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+        if (journal->fd < 0) return nullptr;
+        journal->writer = thread(&EditJournal::run, journal.get());
+        return journal;
+    }
+
+    EditJournal(const EditJournal&) = delete;
+    EditJournal& operator=(const EditJournal&) = delete;
+
+    // Write what is left and stop; remove the journal and checkpoint too if
+    // the session ended cleanly
+    void close(bool remove) {
+        if (!writer.joinable()) return;
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        writer.join();
+        ::close(fd);
+        if (remove) {
+            unlink(journalPath(filePath).c_str());
+            unlink(checkpointPath(filePath).c_str());
+            syncDirectory(filePath);
+        }
+    }
+
+    ~EditJournal() {
+        close(false);
+    }
+
+    // Record an edit that has just been applied to the document
+    void record(bool inserted, size_t pos, const char* text, size_t len) {
+        StageTimer timer(STAGE_JOURNAL);
+        string body;
+        put<uint64_t>(body, pos);
+        body.append(text, len);
+        append(encode(inserted ? INSERT : ERASE, body));
+    }
+
+    // Mark the document as it is now, for a copy about to be written out
+    uint64_t mark() {
+        lock_guard<mutex> guard(lock);
+        uint64_t marker = nextMarker++;
+        string body;
+        put(body, marker);
+        string record = encode(MARKER, body);
+        buffer += record;
+        appended += record.size();
+        markerEnds[marker] = appended;
+        return marker;
+    }
+
+    // The copy for marker has been written and synced as base, with stat
+    // info, and is about to be renamed into place. Returns once the
+    // checkpoint record is on disk, or false if it cannot get there.
+    bool checkpointed(uint64_t marker, Base base, const struct stat& info) {
+        string record = checkpointRecord(marker, base, FileIdentity::of(info));
+        unique_lock<mutex> guard(lock);
+        buffer += record;
+        appended += record.size();
+        checkpoints[marker] = record;
+        uint64_t end = appended;
+        syncWanted = true;
+        wake.notify_one();
+        synced.wait(guard, [&] { return durable >= end || failed || stopping; });
+        return durable >= end;
+    }
+
+    // Start the journal at marker's checkpoint, now that its copy is in place
+    void compact(uint64_t marker) {
+        lock_guard<mutex> guard(lock);
+        compactWanted = max(compactWanted, marker);
+        wake.notify_one();
+    }
+
+    // Bytes in the journal file, including those still to be written
+    uint64_t size() {
+        lock_guard<mutex> guard(lock);
+        return appended - dropped;
+    }
+
+    // False once a write or sync has failed and edits are no longer journaled
+    bool intact() {
+        lock_guard<mutex> guard(lock);
+        return !failed;
+    }
+};
+
+// Completion
+
+// How often each word of a document was seen, and which words followed it
+class DocumentTerms {
+private:
+    map<string, uint32_t> words;   // Ordered, so the words with a prefix are one range
+    unordered_map<string, vector<pair<string, uint32_t>>> followers;  // Most seen first, at most COMPLETION_FOLLOWERS each
+
+    // Count word as seen times more after previous. A full list drops its
+    // rarest follower for a word seen at least as often.
+    void follow(const string& previous, const string& word, uint32_t times) {
+        vector<pair<string, uint32_t>>& after = followers[previous];
+        size_t i = 0;
+        while (i < after.size() && after[i].first != word) i++;
+        if (i == after.size()) {
+            if (after.size() == COMPLETION_FOLLOWERS) {
+                if (after.back().second > times) return;
+                after.pop_back();
+            }
+            i = after.size();
+            after.push_back({word, 0});
+        }
+        after[i].second += times;
+        for (; i > 0 && after[i - 1].second < after[i].second; --i) swap(after[i - 1], after[i]);
+    }
+
+public:
+    // word was seen times more, after previous ("" when it starts a sentence)
+    void add(const string& word, const string& previous, uint32_t times = 1) {
+        words[word] += times;
+        if (!previous.empty()) follow(previous, word, times);
+    }
+
+    // Add everything other has seen, leaving it empty
+    void merge(DocumentTerms&& other) {
+        if (words.empty()) {
+            swap(words, other.words);
+            swap(followers, other.followers);
+        } else {
+            for (auto& word : other.words) words[word.first] += word.second;
+            for (auto& after : other.followers) {
+                for (auto& next : after.second) follow(after.first, next.first, next.second);
+            }
+        }
+        other.words.clear();
+        other.followers.clear();
+    }
+
+    bool empty() const {
+        return words.empty();
+    }
+
+    size_t size() const {
+        return words.size();
+    }
+
+    // The first word at or after prefix; words with the prefix follow it in order
+    map<string, uint32_t>::const_iterator from(const string& prefix) const {
+        return words.lower_bound(prefix);
+    }
+
+    map<string, uint32_t>::const_iterator end() const {
+        return words.end();
+    }
+
+    // Words seen after previous, most often first
+    const vector<pair<string, uint32_t>>& after(const string& previous) const {
+        static const vector<pair<string, uint32_t>> none;
+        auto found = followers.find(previous);
+        return found == followers.end() ? none : found->second;
+    }
+};
+
+// Splits text into the words DocumentTerms counts: runs of letters,
+// lowercased. After a sentence end or a line break the next word follows
+// nothing. Text may be fed in pieces; a word cut between two is joined.
+class TermScanner {
+private:
+    static const size_t LONGEST = 40;   // Longer runs of letters are not words worth learning
+    DocumentTerms* terms;   // Where finished words are counted, nullptr to only follow along
+    string word;            // Letters since the last word ended
+    string previous;        // The last finished word, "" after a sentence end
+
+public:
+    explicit TermScanner(DocumentTerms* terms = nullptr) : terms(terms) {}
+
+    void feed(const char* text, size_t len) {
+        for (size_t i = 0; i < len; ++i) {
+            unsigned char c = text[i];
+            if (isalpha(c)) {
+                word += (char)tolower(c);
+                continue;
+            }
+            if (!word.empty()) {
+                if (terms && word.size() <= LONGEST) terms->add(word, previous);
+                previous.swap(word);
+                word.clear();
+            }
+            if (c == '.' || c == '?' || c == '!' || c == '\n') previous.clear();
+        }
+    }
+
+    // Finish the last word
+    void finish() {
+        feed(" ", 1);
+    }
+
+    // Start again just after context, without counting its words
+    void restart(const string& context) {
+        DocumentTerms* counting = terms;
+        terms = nullptr;
+        word.clear();
+        previous.clear();
+        feed(context.data(), context.size());
+        terms = counting;
+    }
+
+    // Take back text fed last; false if it was not all letters of the unfinished word
+    bool unfeed(const string& text) {
+        if (text.size() > word.size()) return false;
+        size_t start = word.size() - text.size();
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (tolower((unsigned char)text[i]) != word[start + i]) return false;
+        }
+        word.resize(start);
+        return true;
+    }
+
+    // Letters of the word not yet finished, and the word before it
+    const string& partial() const {
+        return word;
+    }
+
+    const string& before() const {
+        return previous;
+    }
+};
+
+// Learns the words of large texts, such as an opened file or a big paste,
+// on a background thread so the editor never waits for them. What it has
+// learned is picked up with take() once resultFd() is readable.
+class TermLearner {
+private:
+    struct Request {
+        Rope text;          // Snapshot, so the editor can keep editing
+        size_t from, to;
+    };
+
+    mutex lock;
+    condition_variable wake;
+    atomic<bool> stopping{false};
+    deque<Request> requests;
+    DocumentTerms learned;        // Learned since the editor last took it
+    uint64_t generation = 0;      // Bumped by restart(), so learning under way is thrown away
+    int editorWake[2];            // Pipe the editor polls for learned words
+    thread worker;
+
+    void run() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [this] { return !requests.empty() || stopping; });
+            if (stopping) break;
+            Request next = move(requests.front());
+            requests.pop_front();
+            uint64_t startedIn = generation;
+            guard.unlock();
+            DocumentTerms terms;
+            TermScanner scanner(&terms);
+            size_t at = next.from;
+            next.text.forEachChunkFrom(next.from, [&](const char* data, size_t len) {
+                size_t used = min(len, next.to - at);
+                scanner.feed(data, used);
+                at += used;
+                return at < next.to && !stopping.load(memory_order_relaxed);
+            });
+            scanner.finish();
+            next = Request();         // Let go of the snapshot before reporting
+            guard.lock();
+            if (generation != startedIn) continue;
+            learned.merge(move(terms));
+            char byte = 1;
+            ssize_t ignored = ::write(editorWake[1], &byte, 1);
+            (void)ignored;
+        }
+    }
+
+public:
+    TermLearner() {
+        if (pipe(editorWake) != 0) {
+            cout << "Could not start the completion learner" << endl;
+            exit(1);
+        }
+        for (int fd : editorWake) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        worker = thread(&TermLearner::run, this);
+    }
+
+    TermLearner(const TermLearner&) = delete;
+    TermLearner& operator=(const TermLearner&) = delete;
+
+    // Stop, dropping whatever is left to learn
+    ~TermLearner() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+        for (int fd : editorWake) close(fd);
+    }
+
+    // Learn the words in [from, to) of text
+    void learn(const Rope& text, size_t from, size_t to) {
+        if (from >= to) return;
+        {
+            lock_guard<mutex> guard(lock);
+            requests.push_back({text, from, to});
+        }
+        wake.notify_one();
+    }
+
+    // Forget what is queued or being learned, for a new document
+    void restart() {
+        lock_guard<mutex> guard(lock);
+        generation++;
+        requests.clear();
+        learned = DocumentTerms();
+    }
+
+    int resultFd() const {
+        return editorWake[0];
+    }
+
+    // Add the words learned since the last call to terms; false if there were none
+    bool take(DocumentTerms& terms) {
+        char drain[64];
+        while (::read(editorWake[0], drain, sizeof(drain)) > 0) {}
+        DocumentTerms found;
+        {
+            lock_guard<mutex> guard(lock);
+            found.merge(move(learned));
+        }
+        if (found.empty()) return false;
+        terms.merge(move(found));
+        return true;
+    }
+};
+
+// Ranks the completions of a prefix from four sources: the words that
+// followed the previous word in this document, completions the user took
+// before, the document's words by how often they appear, and the
+// dictionary's ranked completions. A query gets COMPLETION_BUDGET_US; the
+// document words not reached by then are left out rather than making the
+// key wait.
+class CompletionIndex {
+private:
+    DocumentTerms terms;   // The document's words
+    WordCounts taken;      // Completions the user accepted, by times taken
+
+public:
+    DocumentTerms& documentTerms() {
+        return terms;
+    }
+
+    // Forget the document's words (the user's history is kept)
+    void clear() {
+        terms = DocumentTerms();
+    }
+
+    // The user accepted word as a completion
+    void took(const string& word) {
+        taken[word]++;
+    }
+
+    // Up to k completions of prefix (lowercase letters) typed after previous, best first
+    vector<string> complete(const string& prefix, const string& previous, int k) const {
+        StageTimer timer(STAGE_COMPLETE);
+        vector<string> results;
+        if (prefix.size() < COMPLETION_MIN_PREFIX) return results;
+        auto deadline = chrono::steady_clock::now() + chrono::microseconds(COMPLETION_BUDGET_US);
+        auto extends = [&prefix](const string& word) {
+            return word.size() > prefix.size() && word.compare(0, prefix.size(), prefix) == 0;
+        };
+
+        // A word seen after the previous one counts most, then one the user
+        // took before, then one seen in the document; the dictionary's order
+        // decides among the rest
+        unordered_map<string, uint64_t> scores;
+        for (auto& next : terms.after(previous)) {
+            if (extends(next.first)) scores[next.first] += 64 * (uint64_t)next.second;
+        }
+        vector<string> known = wordBase.read()->suggest(prefix, -1, taken);
+        for (size_t i = 0; i < known.size(); ++i) {
+            if (extends(known[i])) scores[known[i]] += known.size() - i;
+        }
+        size_t scanned = 0;
+        for (auto it = taken.lower_bound(prefix);
+             it != taken.end() && it->first.compare(0, prefix.size(), prefix) == 0 && scanned < COMPLETION_SCAN;
+             ++it, ++scanned) {
+            if (extends(it->first)) scores[it->first] += 16 * (uint64_t)it->second;
+        }
+        scanned = 0;
+        for (auto it = terms.from(prefix);
+             it != terms.end() && it->first.compare(0, prefix.size(), prefix) == 0 && scanned < COMPLETION_SCAN;
+             ++it, ++scanned) {
+            if (scanned % 32 == 31 && chrono::steady_clock::now() > deadline) break;
+            if (extends(it->first)) scores[it->first] += 4 * (uint64_t)it->second;
+        }
+
+        vector<pair<uint64_t, string>> ranked;
+        ranked.reserve(scores.size());
+        for (auto& scored : scores) ranked.push_back({scored.second, scored.first});
+        size_t kept = min(ranked.size(), (size_t)max(0, k));
+        partial_sort(ranked.begin(), ranked.begin() + kept, ranked.end(), [](const pair<uint64_t, string>& a, const pair<uint64_t, string>& b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+        for (size_t i = 0; i < kept; ++i) results.push_back(move(ranked[i].second));
+        return results;
+    }
+};
+
+// Terminal
+
+volatile sig_atomic_t windowResized = 0; // Set by SIGWINCH, cleared by the next frame
+volatile sig_atomic_t latencyRequested = 0; // Set by SIGUSR1, which acts like Ctrl + T
+volatile sig_atomic_t reloadRequested = 0; // Set by SIGUSR2 to reload the dictionary
+
+void onWindowResize(int) {
+    windowResized = 1;
+}
+
+void onLatencyRequest(int) {
+    latencyRequested = 1;
+}
+
+void onReloadRequest(int) {
+    reloadRequested = 1;
+}
+
+// Raw keyboard input and window size on a POSIX terminal. Keys come back with
+// the same codes the editor has always used: special keys are a 224 followed
+// by the key's scan code, backspace is 8 and Enter is 13. Input is read in
+// bulk, so a burst of typing or a paste is decoded from one read().
+class Terminal {
+private:
+    termios original;
+    bool raw = false;
+    string input;        // Bytes read but not yet decoded
+    size_t inputPos = 0; // First undecoded byte in input
+    deque<int> pending;  // Codes still to be returned by nextKey()
+    string paste;        // Text of the last bracketed paste
+
+    // Index just past the parameters (digits and ';') of a sequence starting at from
+    size_t skipParameters(size_t from) const {
+        while (from < input.size() && (isdigit((unsigned char)input[from]) || input[from] == ';')) from++;
+        return from;
+    }
+
+    // Whether input holds a complete escape sequence starting at inputPos
+    bool escapeComplete() const {
+        if (input.size() - inputPos < 2) return false;
+        char kind = input[inputPos + 1];
+        if (kind != '[' && kind != 'O') return true;
+        return skipParameters(inputPos + 2) < input.size();
+    }
+
+public:
+    ~Terminal() {
+        disableRawMode();
+    }
+
+    void enableRawMode() {
+        if (raw || tcgetattr(STDIN_FILENO, &original) == -1) return;
+        termios settings = original;
+        settings.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+        settings.c_oflag &= ~OPOST;
+        settings.c_cflag |= CS8;
+        settings.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+        settings.c_cc[VMIN] = 1;
+        settings.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &settings);
+        signal(SIGWINCH, onWindowResize);
+        raw = true;
+        write("\x1b[?1049h\x1b[?2004h");   // Switch to the alternate screen, mark pastes
+    }
+
+    void disableRawMode() {
+        if (!raw) return;
+        write("\x1b[?2004l\x1b[0m\x1b[2J\x1b[?1049l");  // Reset colours and leave the alternate screen
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &original);
+        raw = false;
+    }
+
+    // Write everything in text to the terminal
+    static void write(const string& text) {
+        size_t done = 0;
+        while (done < text.size()) {
+            ssize_t n = ::write(STDOUT_FILENO, text.data() + done, text.size() - done);
+            if (n <= 0) return;
+            done += n;
+        }
+    }
+
+    // Block until input arrives or timeoutMs passes (-1 waits forever).
+    // Also wakes when one of wakeFds becomes readable. Returns true only
+    // when there is input: false on timeout, on a wake through wakeFds or
+    // when a signal interrupted the wait.
+    bool waitForInput(int timeoutMs, const vector<int>& wakeFds = {}) {
+        if (!pending.empty() || inputPos < input.size()) return true;
+        vector<pollfd> fds = {{STDIN_FILENO, POLLIN, 0}};
+        for (int fd : wakeFds) fds.push_back({fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), timeoutMs) <= 0) return false;
+        return fds[0].revents != 0;
+    }
+
+    // Move every byte that is already waiting on stdin into the input buffer
+    void readAvailable() {
+        if (inputPos == input.size()) {
+            input.clear();
+            inputPos = 0;
+        }
+        char chunk[4096];
+        pollfd stdinPoll = {STDIN_FILENO, POLLIN, 0};
+        while (poll(&stdinPoll, 1, 0) > 0) {
+            ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+            if (n <= 0) break;
+            input.append(chunk, n);
+        }
+    }
+
+    // Decode the next key from what has been read; false when nothing is left
+    bool nextKey(int& code) {
+        if (!pending.empty()) {
+            code = pending.front();
+            pending.pop_front();
+            return true;
+        }
+        while (inputPos < input.size()) {
+            unsigned char c = input[inputPos];
+            if (c != 27) {
+                inputPos++;
+                code = c == 127 ? 8 : c;   // Most terminals send DEL for backspace
+                return true;
+            }
+
+            // An escape sequence arrives in one burst; a lone ESC does not
+            if (!escapeComplete() && waitForMore()) continue;
+            if (input.size() - inputPos < 2 ||
+                (input[inputPos + 1] != '[' && input[inputPos + 1] != 'O')) {
+                inputPos++;
+                code = 27;
+                return true;
+            }
+            size_t params = inputPos + 2;
+            size_t last = skipParameters(params);
+            inputPos = min(last + 1, input.size());
+            if (last >= input.size()) continue;    // Cut off sequence, drop it
+            int scanCode = 0;
+            switch (input[last]) {
+                case 'A': scanCode = 72; break;    // Up arrow
+                case 'B': scanCode = 80; break;    // Down arrow
+                case 'C': scanCode = 77; break;    // Right arrow
+                case 'D': scanCode = 75; break;    // Left arrow
+                case '~':
+                    if (atoi(input.c_str() + params) == 3) scanCode = 83;  // Delete
+                    if (atoi(input.c_str() + params) == 200) {             // Start of a paste
+                        readPaste();
+                        code = PASTE_KEY;
+                        return true;
+                    }
+                    break;
+            }
+            if (scanCode == 0) continue;   // Ignore sequences the editor has no use for
+            pending.push_back(scanCode);
+            code = 224;
+            return true;
+        }
+        return false;
+    }
+
+    // Give the rest of a split escape sequence a moment to arrive
+    bool waitForMore(int timeoutMs = ESCAPE_WAIT_MS) {
+        size_t before = input.size();
+        pollfd stdinPoll = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&stdinPoll, 1, timeoutMs) > 0) readAvailable();
+        return input.size() > before;
+    }
+
+    // Take everything up to the end of a bracketed paste as its text, so a
+    // paste is one key however long it is. If the end never arrives, what
+    // did arrive is the paste.
+    void readPaste() {
+        static const string end = "\x1b[201~";
+        paste.clear();
+        size_t found;
+        while ((found = input.find(end, inputPos)) == string::npos) {
+            size_t keep = input.size() - min(input.size() - inputPos, end.size() - 1);  // May start the end marker
+            paste.append(input, inputPos, keep - inputPos);
+            inputPos = keep;
+            if (!waitForMore(PASTE_WAIT_MS)) {
+                found = input.size();
+                break;
+            }
+        }
+        paste.append(input, inputPos, found - inputPos);
+        inputPos = min(found + end.size(), input.size());
+    }
+
+    const string& pastedText() const {
+        return paste;
+    }
+
+    // Rows and columns of the terminal window
+    void windowSize(int& rows, int& cols) {
+        winsize size;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == -1 || size.ws_col == 0) {
+            rows = 24;
+            cols = 80;
+        } else {
+            rows = size.ws_row;
+            cols = size.ws_col;
+        }
+    }
+};
+
+// ANSI escape sequence for one of the console colours in ThemeColors
+// (bit 0 blue, bit 1 green, bit 2 red, bit 3 bright)
+string ansiColor(int consoleColor) {
+    int ansi = ((consoleColor & 4) ? 1 : 0) | ((consoleColor & 2) ? 2 : 0) | ((consoleColor & 1) ? 4 : 0);
+    int base = (consoleColor & 8) ? 90 : 30;
+    return "\x1b[0;" + to_string(base + ansi) + "m";
+}
+
+// Keeps a copy of what is on the screen and only rewrites the rows that
+// changed since the last frame, sending the whole frame in one write. The
+// cost of a frame depends on the window size, not on the document.
+class ScreenRenderer {
+private:
+    vector<string> shown;   // Rows as they are currently on the screen
+    int shownCursorRow = -1, shownCursorCol = -1;
+
+public:
+    // Forget the screen contents so the next frame redraws every row
+    void invalidate() {
+        shown.clear();
+    }
+
+    // The output that brings the screen from the last frame to this one;
+    // empty when nothing changed
+    string frame(const vector<string>& rows, int cursorRow, int cursorCol) {
+        string frame;
+        if (shown.size() != rows.size()) {
+            frame += "\x1b[0m\x1b[2J";
+            shown.assign(rows.size(), string(1, '\0'));  // Matches no real row
+        }
+        for (size_t r = 0; r < rows.size(); ++r) {
+            if (rows[r] == shown[r]) continue;
+            frame += "\x1b[" + to_string(r + 1) + ";1H";
+            frame += rows[r];
+            frame += "\x1b[K";    // Clear whatever the old row left behind
+            shown[r] = rows[r];
+        }
+        if (frame.empty() && cursorRow == shownCursorRow && cursorCol == shownCursorCol) return frame;
+        frame = "\x1b[?25l" + frame;  // Hide the cursor while rows change
+        frame += "\x1b[" + to_string(cursorRow + 1) + ";" + to_string(cursorCol + 1) + "H\x1b[?25h";
+        shownCursorRow = cursorRow;
+        shownCursorCol = cursorCol;
+        return frame;
+    }
+};
+
+// Keystroke Traces
+
+// A trace is a text file with one key per line, in the codes handleKey()
+// takes:
+//   104          a key code (here 'h')
+//   224 75       a special key: 224 and its scan code (here the left arrow)
+//   type Hello   each character after "type " as a key
+//   paste a\nb   a bracketed paste; \n, \r, \t and \\ are escapes
+// Blank lines and lines starting with # are skipped.
+struct TraceEvent {
+    int code = 0;
+    int scanCode = 0;
+    string text;   // What a paste inserts
+};
+
+// Read the events of a trace file. On failure error says which line was
+// not understood.
+bool readTrace(const string& path, vector<TraceEvent>& events, string& error) {
+    ifstream file(path);
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+    string line;
+    for (int number = 1; getline(file, line); ++number) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        TraceEvent event;
+        if (line.compare(0, 5, "type ") == 0) {
+            for (size_t i = 5; i < line.size(); ++i) {
+                event.code = (unsigned char)line[i];
+                events.push_back(event);
+            }
+            continue;
+        }
+        if (line.compare(0, 6, "paste ") == 0) {
+            event.code = PASTE_KEY;
+            for (size_t i = 6; i < line.size(); ++i) {
+                char c = line[i];
+                if (c == '\\' && i + 1 < line.size()) {
+                    c = line[++i];
+                    c = c == 'n' ? '\n' : c == 'r' ? '\r' : c == 't' ? '\t' : c;
+                }
+                event.text += c;
+            }
+            events.push_back(event);
+            continue;
+        }
+        istringstream fields(line);
+        string rest;
+        if (!(fields >> event.code) || (event.code == 224 && !(fields >> event.scanCode)) || (fields >> rest)
+            || event.code < 0 || event.code > 255) {
+            error = path + ":" + to_string(number) + ": not a key: " + line;
+            return false;
+        }
+        events.push_back(event);
+    }
+    return true;
+}
+
+// The trace line for one event
+string traceLine(const TraceEvent& event) {
+    if (event.code == 224) return "224 " + to_string(event.scanCode);
+    if (event.code != PASTE_KEY) return to_string(event.code);
+    string line = "paste ";
+    for (char c : event.text) {
+        if (c == '\n') line += "\\n";
+        else if (c == '\r') line += "\\r";
+        else if (c == '\t') line += "\\t";
+        else if (c == '\\') line += "\\\\";
+        else line += c;
+    }
+    return line;
+}
+
+// What a key does, for grouping replay timings
+const char* keyName(const TraceEvent& event) {
+    if (event.code == PASTE_KEY) return "paste";
+    if (event.code == 224) {
+        switch (event.scanCode) {
+            case 72: return "up";
+            case 80: return "down";
+            case 75: return "left";
+            case 77: return "right";
+            case 83: return "delete";
+        }
+        return "special";
+    }
+    switch (event.code) {
+        case 8: return "backspace";
+        case 9: return "autocomplete";
+        case 13: return "enter";
+        case 32: return "space";
+        case 6: return "find";
+        case 7: return "goto";
+        case 19: return "save";
+        case 25: return "redo";
+        case 26: return "undo";
+        case 27: return "escape";
+    }
+    return event.code >= 32 && event.code < 127 ? "type" : "control";
+}
+
+// Text Editor Settings
+
+long long int totalWords = 0;
+const vector<int> ThemeColors = {7, 9, 10, 12, 13, 14}; // Theme: Default, Blue, Green, Red, Magenta, Yellow
+auto currentColor = ThemeColors.begin();
+class text_ed {
+    friend void runBenchmarks(const string& filter, FILE* out);
+
+private:
+    Rope document;                // The whole text, lines separated by '\n'
+    int currentLine = 0;          // Current line being edited
+    size_t currentLineStart = 0;  // Offset of the first character of currentLine
+    size_t cursorPosX = 0;        // Cursor column within the line
+    int cursorPosY = 0;           // Console row of the cursor
+
+    UndoJournal history;    // Edits for undo and redo
+    unsigned long long savedGeneration = 0;  // history.generation() when last saved
+    bool savedOnce = false;                  // Whether the file has been written yet
+    unsigned long long queuedGeneration = 0; // history.generation() last handed to the saver
+    bool saveFailed = false;                 // The last finished save could not be written
+    string filePath = "myDoc.txt";           // Where save() writes the document
+    bool openedFile = false;                 // filePath was opened, so save() replaces it as is
+    shared_ptr<MappedFile> countingFile;     // Opened file whose words are still being counted
+    long long int exportedWords = -1;        // Count last written to word_count.txt
+    chrono::steady_clock::time_point lastExport;
+
+    CompletionIndex completions;            // Ranks Tab completions of the word being typed
+    TermLearner learner;                    // Learns the words of opened and pasted text for completions
+    TermScanner typing{&completions.documentTerms()};  // Fed what is typed, so it holds the word at typingAt
+    size_t typingAt = string::npos;         // Offset typing has followed the text to, npos when it must catch up
+    unsigned long long typingVersion = 0;   // document.version() when typing last caught up
+    string completionHint;                  // Best completion at hintAt, shown on the status line
+    size_t hintAt = string::npos;           // Cursor offset completionHint is for, npos when out of date
+    unsigned long long hintVersion = 0;     // document.version() and dictionary version completionHint is for
+    uint64_t hintDictionary = 0;
+
+    Terminal terminal;
+    ScreenRenderer screen;
+    int screenRows = 24, screenCols = 80;   // Terminal size, the last row is the status line
+    int topLine = 0;                        // First line shown
+    size_t leftCol = 0;                     // First column shown
+    string textColor = ansiColor(DEFAULT_CONSOLE_COLOR);  // SGR sequence every text row starts with
+    bool gotoMode = false;                  // Reading a line number after Ctrl + G
+    string gotoInput;                       // Digits typed so far
+    bool findMode = false;                  // Reading a search after Ctrl + F
+    bool replaceMode = false;               // Reading the replacement after Ctrl + A in find mode
+    string findInput, replaceInput;
+    SearchOptions findOptions;
+    size_t findOrigin = 0;                  // Cursor offset when the search started
+    size_t matchPos = string::npos;         // Match the cursor is on, if any
+    string notice;                          // Shown on the status line until the next key
+    ofstream recording;                     // Trace of the keys typed, if recording
+    string latencyPath = "latency.txt";     // Where Ctrl + T and SIGUSR1 write the latency stats
+
+    SpellChecker spellChecker{wordBase, "suggestions.txt"};  // Checks words off the editing thread
+    unique_ptr<EditJournal> journal;        // Crash journal of this session's edits, if it could be created
+    uint64_t checkpointMarker = 0;          // Journal marker of the checkpoint being written, 0 if none
+    uint64_t checkpointAfter = JOURNAL_CHECKPOINT_BYTES;  // Journal size that starts the next checkpoint
+    BackgroundSaver saver;                  // Writes saves off the editing thread (declared after journal, stops first)
+    chrono::seconds autosaveInterval{0};    // 0 when autosave is off
+    chrono::steady_clock::time_point lastSave = chrono::steady_clock::now();
+    struct LineSpelling {
+        Misspellings misspelt;
+        bool checked;       // False while the worker has the line
+    };
+    unordered_map<uint64_t, LineSpelling> lineSpelling;  // Checked lines, by lineKey() of their text
+    uint64_t spellingVersion = 0;           // Dictionary version lineSpelling was checked against
+
+    // Offset of the cursor in the document
+    size_t cursorOffset() const {
+        return currentLineStart + cursorPosX;
+    }
+
+    // Length of the line the cursor is on
+    size_t currentLineLength() const {
+        return document.lineLength(currentLine);
+    }
+
+    // The word directly before the cursor (up to the last space)
+    string currentWord() {
+        size_t start = cursorPosX;
+        while (start > 0 && document.charAt(currentLineStart + start - 1) != ' ') start--;
+        string str;
+        document.copy(currentLineStart + start, cursorPosX - start, str);
+        return str;
+    }
+
+    // Bring typing up to offset at. While keys are typed at the cursor it
+    // is already there; after the cursor jumps or the text changes under
+    // it, the COMPLETION_CONTEXT_BYTES before at are read again.
+    void catchUpTyping(size_t at) {
+        if (typingAt == at && typingVersion == document.version()) return;
+        size_t from = at > COMPLETION_CONTEXT_BYTES ? at - COMPLETION_CONTEXT_BYTES : 0;
+        string context;
+        document.copy(from, at - from, context);
+        typing.restart(context);
+        typingAt = at;
+        typingVersion = document.version();
+    }
+
+    // Best completion of the word being typed, "" if there is none. It is
+    // ranked once per edit or cursor move, not on every frame.
+    const string& bestCompletion() {
+        size_t cursor = cursorOffset();
+        if (hintAt == cursor && hintVersion == document.version() && hintDictionary == wordBase.version()) return completionHint;
+        catchUpTyping(cursor);
+        vector<string> found = completions.complete(typing.partial(), typing.before(), 1);
+        completionHint = found.empty() ? "" : found[0];
+        hintAt = cursor;
+        hintVersion = document.version();
+        hintDictionary = wordBase.version();
+        return completionHint;
+    }
+
+    // Start learning the words of a newly loaded document for completions
+    void learnDocument() {
+        completions.clear();
+        learner.restart();
+        learner.learn(document, 0, min(document.size(), COMPLETION_LEARN_BYTES));
+        typingAt = hintAt = string::npos;
+    }
+
+    // Take the words the learner has finished; true if any arrived
+    bool collectTerms() {
+        if (!learner.take(completions.documentTerms())) return false;
+        hintAt = string::npos;
+        return true;
+    }
+
+    // Scroll so the cursor is inside the window
+    void scrollToCursor() {
+        int textRows = max(1, screenRows - 1);
+        if (currentLine < topLine) topLine = currentLine;
+        if (currentLine >= topLine + textRows) topLine = currentLine - textRows + 1;
+        if (cursorPosX < leftCol) leftCol = cursorPosX;
+        if (cursorPosX >= leftCol + screenCols) leftCol = cursorPosX - screenCols + 1;
+    }
+
+    // Hand the word before the cursor to the spellcheck worker
+    void checkSpelling() {
+        string word = cleanWord(currentWord());
+        if (!word.empty()) spellChecker.check(word);
+    }
+
+    // Cache key for a line: a hash of its text. An edited line gets a new
+    // key, so its old entry simply stops being used, and identical lines
+    // (or a line restored by undo) share one.
+    static uint64_t lineKey(const string& text) {
+        uint64_t hash = 14695981039346656037ull;   // 64-bit FNV-1a
+        for (unsigned char c : text) {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    // Misspellings of a line, or nullptr until the worker has checked it.
+    // Only lines not seen before are sent, so each edit costs a recheck of
+    // the lines it changed.
+    const Misspellings* misspellingsOf(const string& text) {
+        uint64_t key = lineKey(text);
+        auto cached = lineSpelling.find(key);
+        if (cached != lineSpelling.end()) return cached->second.checked ? &cached->second.misspelt : nullptr;
+        if (lineSpelling.size() >= SPELL_CACHE_LINES) lineSpelling.clear();
+        if (spellChecker.checkLine(key, text)) lineSpelling[key] = {Misspellings(), false};
+        return nullptr;
+    }
+
+    // Take the lines the worker has checked; true if any arrived. Once the
+    // dictionary changes every line is checked again.
+    bool collectSpelling() {
+        bool any = false;
+        if (wordBase.version() != spellingVersion) {
+            spellingVersion = wordBase.version();
+            lineSpelling.clear();
+            any = true;
+        }
+        SpellResult result;
+        while (spellChecker.nextResult(result)) {
+            if (result.version < spellingVersion) continue;   // Checked against an older dictionary
+            lineSpelling[result.key] = {move(result.misspelt), true};
+            any = true;
+        }
+        return any;
+    }
+
+    // Add the word before the cursor to the dictionary (Ctrl + D)
+    void addCurrentWord() {
+        string word = cleanWord(currentWord());
+        if (word.empty()) return;
+        if (wordBase.addWord(word)) {
+            notice = "Added \"" + word + "\" to the dictionary";
+        } else if (wordBase.read()->exists(word)) {
+            notice = "\"" + word + "\" is already in the dictionary";
+        } else {
+            notice = "Only letters can be added to the dictionary";
+        }
+    }
+
+    // Underline the misspelt words in the part of a line shown on screen,
+    // which starts at column from. The word being typed at column cursor
+    // (-1 for none) is left alone.
+    static string markMisspellings(const string& text, size_t from, const Misspellings& misspelt, int cursor) {
+        string marked;
+        size_t done = 0;   // Characters of text already copied
+        for (auto& word : misspelt) {
+            size_t start = word.first, end = word.first + word.second;
+            if (cursor >= 0 && (size_t)cursor >= start && (size_t)cursor <= end) continue;
+            if (end <= from || start >= from + text.size()) continue;
+            start = max(start, from) - from;
+            end = min(end, from + text.size()) - from;
+            marked.append(text, done, start - done);
+            marked += "\x1b[4m";
+            marked.append(text, start, end - start);
+            marked += "\x1b[24m";
+            done = end;
+        }
+        marked.append(text, done, string::npos);
+        return marked;
+    }
+
+    // Helper function to display the current text. Only the lines inside the
+    // window are read from the document; the renderer sends just the rows
+    // that changed.
+    void displayText() {
+        StageTimer timer(STAGE_PAINT);
+        if (windowResized) {
+            windowResized = 0;
+            terminal.windowSize(screenRows, screenCols);
+            screen.invalidate();
+        }
+        Terminal::write(renderFrame());
+    }
+
+    // Build the rows of the screen and return what has to be written to
+    // bring the terminal up to date with them
+    string renderFrame() {
+        scrollToCursor();
+
+        int textRows = max(1, screenRows - 1);
+        vector<string> rows;
+        rows.reserve(screenRows);
+        for (int r = 0; r < textRows; ++r) {
+            size_t line = topLine + r;
+            string row = textColor;
+            if (document.hasLine(line)) {
+                size_t start = document.lineStart(line);
+                size_t length = document.lineLength(line);
+                string whole;
+                document.copy(start, length, whole);
+                const Misspellings* misspelt = misspellingsOf(whole);
+                if (leftCol < length) {
+                    string text = whole.substr(leftCol, screenCols);
+                    replace_if(text.begin(), text.end(), [](char c) { return iscntrl((unsigned char)c); }, ' ');
+                    int cursor = (int)line == currentLine ? (int)cursorPosX : -1;
+                    // The match found by Ctrl + F is shown in reverse video
+                    size_t matchStart = text.size(), matchEnd = text.size();
+                    if (findMode && matchPos != string::npos && matchPos >= start && matchPos < start + length) {
+                        matchStart = min(text.size(), max(matchPos - start, leftCol) - leftCol);
+                        matchEnd = min(text.size(), max(matchPos - start + findInput.size(), leftCol) - leftCol);
+                    }
+                    string before = text.substr(0, matchStart), found = text.substr(matchStart, matchEnd - matchStart);
+                    string after = text.substr(matchEnd);
+                    if (misspelt) {
+                        before = markMisspellings(before, leftCol, *misspelt, cursor);
+                        after = markMisspellings(after, leftCol + matchEnd, *misspelt, cursor);
+                    }
+                    row += before + (found.empty() ? "" : "\x1b[7m" + found + "\x1b[27m") + after;
+                }
+            } else {
+                row += "~";
+            }
+            rows.push_back(row);
+        }
+
+        // Status line: word count, position and the suggestion for the word at the cursor
+        string words = countingFile ? "counting" : to_string(totalWords);
+        string status = " Words: " + words + "  Ln " + to_string(currentLine + 1)
+                      + ", Col " + to_string(cursorPosX + 1) + (isStateChanged() ? "  [modified]" : "")
+                      + (saveFailed ? "  [save failed]" : "")
+                      + (journal && !journal->intact() ? "  [journal failed]" : "");
+        if (gotoMode) status = " Go to line: " + gotoInput;
+        if (findMode) {
+            status = " Find: " + findInput + (!findInput.empty() && matchPos == string::npos ? "  (not found)" : "")
+                   + "  [^T Case: " + (findOptions.ignoreCase ? "off" : "on") + "] [^W Word: "
+                   + (findOptions.wholeWord ? "on" : "off") + "] [^A Replace all]";
+        }
+        if (replaceMode) status = " Replace all \"" + findInput + "\" with: " + replaceInput;
+        if (!notice.empty()) status = " " + notice;
+        string hint;
+        if (!bestCompletion().empty()) hint = "  * " + completionHint;  // Suggestion indicator and suggested word
+        status = status.substr(0, screenCols);
+        hint = hint.substr(0, screenCols - status.size());
+        rows.push_back("\x1b[0;7m" + status + ansiColor(HIGHLIGHT_COLOR) + hint);
+
+        return screen.frame(rows, currentLine - topLine, (int)(cursorPosX - leftCol));
+    }
+
+    // Function to check if the document differs from the last saved copy
+    bool isStateChanged() const {
+        StageTimer timer(STAGE_STATE);
+        return history.generation() != savedGeneration;
+    }
+
+    // Place the cursor at a document offset
+    void setCursorOffset(size_t offset) {
+        currentLine = document.lineOf(offset);
+        currentLineStart = document.lineStart(currentLine);
+        cursorPosY = currentLine;
+        cursorPosX = offset - currentLineStart;
+    }
+
+    // Number of words that begin inside text, given the character before it
+    static long long int wordStarts(char before, const char* text, size_t len) {
+        long long int starts = 0;
+        bool inWord = !isspace((unsigned char)before);
+        for (size_t i = 0; i < len; ++i) {
+            bool space = isspace((unsigned char)text[i]);
+            if (!space && !inWord) starts++;
+            inWord = !space;
+        }
+        return starts;
+    }
+
+    // Change in the word count if text sat between the characters before and after
+    // instead of those two being adjacent
+    static long long int wordDelta(char before, const char* text, size_t len, char after) {
+        if (len == 0) return 0;
+        return wordStarts(before, text, len) + wordStarts(text[len - 1], &after, 1)
+             - wordStarts(before, &after, 1);
+    }
+
+    // Every change to the document goes through these two, so the word count
+    // is kept up to date from the edited text and its two neighbours alone
+    void applyInsert(size_t pos, const char* text, size_t len) {
+        char before = pos > 0 ? document.charAt(pos - 1) : ' ';
+        char after = pos < document.size() ? document.charAt(pos) : ' ';
+        totalWords += wordDelta(before, text, len, after);
+        document.insert(pos, text, len);
+        if (journal) journal->record(true, pos, text, len);
+    }
+
+    void applyErase(size_t pos, const string& removed) {
+        char before = pos > 0 ? document.charAt(pos - 1) : ' ';
+        size_t end = pos + removed.size();
+        char after = end < document.size() ? document.charAt(end) : ' ';
+        totalWords -= wordDelta(before, removed.data(), removed.size(), after);
+        document.erase(pos, removed.size());
+        if (journal) journal->record(false, pos, removed.data(), removed.size());
+    }
+
+    // Apply an undo journal entry forwards (redo) or backwards (undo)
+    void applyEdit(const EditOp& op, bool forward) {
+        if (op.inserted == forward) {
+            applyInsert(op.pos, op.text.data(), op.text.size());
+        } else {
+            applyErase(op.pos, op.text);
+        }
+    }
+
+    // Insert text at pos and record it for undo; the cursor ends up at cursorAfter
+    // Text up to COMPLETION_TYPED_BYTES is fed to typing, which learns the
+    // words it finishes; larger text is learned in the background.
+    void insertText(size_t pos, const string& text, size_t cursorAfter) {
+        size_t cursorBefore = cursorOffset();
+        bool typed = text.size() <= COMPLETION_TYPED_BYTES;
+        if (typed) catchUpTyping(pos);
+        applyInsert(pos, text.data(), text.size());
+        history.record(true, pos, text.data(), text.size(), cursorBefore, cursorAfter);
+        if (typed) {
+            typing.feed(text.data(), text.size());
+            typingAt = pos + text.size();
+            typingVersion = document.version();
+        } else {
+            learner.learn(document, pos, pos + text.size());
+        }
+    }
+
+    // Remove len characters at pos and record them for undo
+    void eraseText(size_t pos, size_t len, size_t cursorAfter) {
+        size_t cursorBefore = cursorOffset();
+        string removed;
+        document.copy(pos, len, removed);
+        bool following = typingAt == pos + len && typingVersion == document.version();
+        applyErase(pos, removed);
+        history.record(false, pos, removed.data(), len, cursorBefore, cursorAfter);
+        if (following && typing.unfeed(removed)) {   // Backspace within the word being typed
+            typingAt = pos;
+            typingVersion = document.version();
+        }
+    }
+
+public:
+    text_ed() {
+        FILE *fp;
+        fp = fopen("word_count.txt","w");
+        if(!fp)
+        {
+            cout << "File did not open" << endl;
+            exit(1);
+        }
+        fprintf(fp, "Current Word Count: %lld", totalWords);  // Initialize the word count 0 right when text_ed object is created.
+        fclose(fp);
+    }
+
+    // Edit path. Large files are mapped rather than read: the first screen
+    // draws at once, and only the parts that are edited get copied. A path
+    // that does not exist yet starts an empty document saved there.
+    bool open(const string& path) {
+        filePath = path;
+        openedFile = true;
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0 && errno == ENOENT) return true;
+        if (!load(path)) return false;
+        savedOnce = true;
+        savedGeneration = queuedGeneration = history.generation();
+        return true;
+    }
+
+    // Make the document the contents of path
+    bool load(const string& path) {
+        shared_ptr<MappedFile> file = MappedFile::open(path);
+        if (!file) return false;
+        document.load(file);
+        countingFile = file;  // totalWords gains the file's words once it is scanned
+        totalWords = 0;
+        learnDocument();
+        return true;
+    }
+
+    // Replay the edits a crashed session left in the journal, as one undo
+    // step, then journal this session's edits. The file being edited is
+    // only the starting point when nothing newer was checkpointed.
+    void startJournal() {
+        EditJournal::Recovered found;
+        EditJournal::Base base = openedFile && savedOnce ? EditJournal::BASE_FILE : EditJournal::BASE_EMPTY;
+        if (EditJournal::recover(filePath, found)) {
+            bool loaded = true;
+            if (found.base == EditJournal::BASE_FILE) {
+                loaded = load(filePath);
+            } else if (found.base == EditJournal::BASE_CHECKPOINT) {
+                loaded = load(EditJournal::checkpointPath(filePath));
+            } else {
+                document = Rope();
+                countingFile.reset();
+                totalWords = 0;
+                learnDocument();
+            }
+            if (!loaded) return;  // Leave the journal alone for another try
+            size_t cursor = 0;
+            for (const EditOp& op : found.edits) {
+                if (op.pos + (op.inserted ? 0 : op.text.size()) > document.size()) break;  // Damaged journal
+                if (op.inserted) {
+                    cursor = op.pos + op.text.size();
+                    insertText(op.pos, op.text, cursor);
+                } else {
+                    string removed;
+                    document.copy(op.pos, op.text.size(), removed);
+                    if (removed != op.text) break;
+                    cursor = op.pos;
+                    eraseText(op.pos, op.text.size(), cursor);
+                }
+            }
+            history.closeGroup();
+            setCursorOffset(cursor);
+            base = found.base;
+            if (base != EditJournal::BASE_FILE) savedGeneration = queuedGeneration = ~0ULL;  // The file on disk is older
+        } else if (access(EditJournal::journalPath(filePath).c_str(), F_OK) == 0) {
+            // Written for a version of the file that is gone; keep it for the user but start over
+            string stale = EditJournal::journalPath(filePath) + ".stale";
+            rename(EditJournal::journalPath(filePath).c_str(), stale.c_str());
+            cerr << "Journal did not match " << filePath << ", kept as " << stale << endl;
+        }
+        journal = EditJournal::open(filePath, found, base);
+    }
+
+    // Save every seconds while there are unsaved changes (0 turns it off)
+    void setAutosave(int seconds) {
+        autosaveInterval = chrono::seconds(max(0, seconds));
+    }
+
+    // Add the opened file's words to the count once the background scan is
+    // done; edits made meanwhile have already added their own deltas
+    bool collectWordCount() {
+        if (!countingFile || !countingFile->scanned()) return false;
+        totalWords += countingFile->words();
+        countingFile.reset();
+        return true;
+    }
+
+    // Insert a character at the current cursor position with auto-capitalization
+    void insert_capital(char ch) {
+        StageTimer timer(STAGE_INSERT);
+        // Capitalize if it's the first character being inserted or follows a newline or period, only works "." and ". " or multiple ".... "
+        bool caps = false; // caps stores the state, whether to capitalize or not
+        size_t offset = cursorOffset();
+        // Check if there is nothing before the cursor which implies that it is the first character
+        if (cursorPosX == 0) {
+            caps = true;  // initialize state to be capitalized
+        } else {
+            char lastChar = document.charAt(offset - 1);
+
+            // Check if the last character is a newline or a full stop
+            if (lastChar == '\n' || lastChar == '.' || lastChar == '?' || lastChar == '!') {
+                caps = true; // Capitalize the next character
+            } else if (lastChar == ' ') {
+                // Check the second last character (if it exists)
+                if (cursorPosX > 1) {
+                    char secondLast = document.charAt(offset - 2);
+                    if (secondLast == '.' || secondLast == '!' || secondLast == '?') {
+                        caps = true; // Capitalize after a space following a period
+                    }
+                }
+            }
+        }
+
+        // Insert the character (capitalize if needed)
+        insertText(offset, string(1, caps ? toupper(ch) : ch), offset + 1);
+        cursorPosX++;
+        if (isspace(ch)) history.closeGroup(); // A finished word is one undo step
+    }
+
+    // Whether insert_capital() capitalizes a character typed after before2 before1
+    static bool startsSentence(char before2, char before1) {
+        if (before1 == '\n' || before1 == '.' || before1 == '?' || before1 == '!') return true;
+        return before1 == ' ' && (before2 == '.' || before2 == '?' || before2 == '!');
+    }
+
+    // Capitalize text as if it had been typed a character at a time after
+    // before2 before1. Only letters change and the rule never looks at a
+    // letter, so every position is decided on its own: SSE2 does 16 at once.
+    static void capitalizeBlock(char before2, char before1, string& text) {
+        size_t i = 0;
+        for (; i < min<size_t>(2, text.size()); ++i) {
+            if (startsSentence(i == 0 ? before2 : before1, i == 0 ? before1 : text[0])) text[i] = toupper((unsigned char)text[i]);
+        }
+#ifdef __SSE2__
+        auto is = [](__m128i bytes, char c) { return _mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)); };
+        for (; i + 16 <= text.size(); i += 16) {
+            __m128i c = _mm_loadu_si128((const __m128i*)(text.data() + i));
+            __m128i p1 = _mm_loadu_si128((const __m128i*)(text.data() + i - 1));
+            __m128i p2 = _mm_loadu_si128((const __m128i*)(text.data() + i - 2));
+            __m128i end1 = _mm_or_si128(_mm_or_si128(is(p1, '.'), is(p1, '?')), is(p1, '!'));
+            __m128i end2 = _mm_or_si128(_mm_or_si128(is(p2, '.'), is(p2, '?')), is(p2, '!'));
+            __m128i starts = _mm_or_si128(_mm_or_si128(end1, is(p1, '\n')), _mm_and_si128(is(p1, ' '), end2));
+            __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('z' + 1)));
+            __m128i flip = _mm_and_si128(_mm_and_si128(starts, lower), _mm_set1_epi8(0x20));
+            _mm_storeu_si128((__m128i*)(text.data() + i), _mm_sub_epi8(c, flip));
+        }
+#endif
+        for (; i < text.size(); ++i) {
+            if (startsSentence(text[i - 2], text[i - 1])) text[i] = toupper((unsigned char)text[i]);
+        }
+    }
+
+    // Insert a paste at the cursor as one edit: one capitalization pass, one
+    // word count update, one undo step and one journal record. Line breaks
+    // become '\n', tabs four spaces, and other control characters are dropped.
+    void pasteText(const string& pasted) {
+        string text;
+        text.reserve(pasted.size());
+        for (size_t i = 0; i < pasted.size(); ++i) {
+            unsigned char c = pasted[i];
+            if (c == '\r') {
+                text += '\n';
+                if (i + 1 < pasted.size() && pasted[i + 1] == '\n') i++;
+            } else if (c == '\t') {
+                text.append(4, ' ');
+            } else if (c == '\n' || (c >= 32 && c != 127)) {
+                text += (char)c;
+            }
+        }
+        if (text.empty()) return;
+        size_t offset = cursorOffset();
+        char before1 = offset > 0 ? document.charAt(offset - 1) : '\n';
+        char before2 = offset > 1 ? document.charAt(offset - 2) : '\n';
+        capitalizeBlock(before2, before1, text);
+        history.closeGroup();
+        insertText(offset, text, offset + text.size());
+        history.closeGroup();
+        setCursorOffset(offset + text.size());
+    }
+
+    // Move the cursor to the left
+    void moveCursorLeft() {
+        if (cursorPosX > 0) cursorPosX--;
+        history.closeGroup();
+    }
+
+    // Move the cursor to the right
+    void moveCursorRight() {
+        if (cursorPosX < currentLineLength()) {
+            cursorPosX++;
+            history.closeGroup();
+        } else {
+            insert_capital(' ');  // Moving past the end of the line pads it with a space
+        }
+    }
+
+    // Move the cursor up
+    void moveCursorUp() {
+        if (currentLine > 0) {
+            currentLine--;                              // Move to the previous line
+            currentLineStart = document.lineStart(currentLine);
+            cursorPosY = max(cursorPosY - 1, 0);        // Update cursor Y position
+            cursorPosX = currentLineLength();           // Move the cursor to the end of the previous line
+        }
+        history.closeGroup();
+    }
+
+    // Move the cursor down
+    void moveCursorDown() {
+        if (document.hasLine(currentLine + 1)) {
+            currentLine++;                              // Move to the next line
+            currentLineStart = document.lineStart(currentLine);
+            cursorPosY++;                               // Update cursor Y position
+            cursorPosX = currentLineLength();           // Move the cursor to the end of the next line
+        }
+        history.closeGroup();
+    }
+
+    // Jump to the start of a line (0-based)
+    void goToLine(int line) {
+        line = max(0, line);
+        currentLine = document.hasLine(line) ? line : document.lineCount() - 1;  // Only count the whole file when jumping past its end
+        currentLineStart = document.lineStart(currentLine);
+        cursorPosY = currentLine;
+        cursorPosX = 0;
+        history.closeGroup();
+    }
+
+    // Move to the first match of the search at or after from, wrapping
+    // round; with no match the cursor goes back to where the search began
+    void findFrom(size_t from) {
+        matchPos = findInput.empty() ? string::npos : TextSearch(findInput, findOptions).next(document, from);
+        setCursorOffset(matchPos != string::npos ? matchPos : findOrigin);
+        history.closeGroup();
+    }
+
+    // Replace every match of the search with replacement as one undo step.
+    // The document is rebuilt in a single pass. When matches are dense the
+    // undo history and journal get the changed span as one erase and one
+    // insert rather than an edit per match.
+    size_t replaceAll(const string& replacement) {
+        TextSearch search(findInput, findOptions);
+        vector<size_t> positions = search.all(document);
+        if (positions.empty()) return 0;
+        size_t count = positions.size(), m = search.length(), r = replacement.size();
+        size_t first = positions.front(), oldSpan = positions.back() + m - first;
+        size_t newSpan = oldSpan + count * r - count * m;
+        bool wholeSpan = oldSpan + newSpan < count * (m + r + 2 * sizeof(EditOp));
+
+        // One copy around each match gives the text it replaces and how the
+        // word count changes: a word can only start or end at its edges
+        vector<string> matched(wholeSpan ? 0 : count);
+        long long wordDelta = 0;
+        char prevAfter = ' ';
+        string around, after;
+        Rope::Reader reader(document);
+        for (size_t i = 0; i < count; ++i) {
+            size_t start = positions[i];
+            size_t end = min(start + m + 1, document.size());
+            if (i + 1 < count) end = min(end, positions[i + 1]);
+            size_t from = start > 0 ? start - 1 : start;
+            around.clear();
+            reader.copy(from, end - from, around);
+            char prev = start > 0 ? around[0] : ' ';
+            const char* text = around.data() + (start - from);
+            if (!wholeSpan) matched[i].assign(text, m);
+            if (i == 0 || positions[i - 1] + m != start) prevAfter = prev;
+            else if (r > 0) prevAfter = replacement.back();
+            after = replacement;
+            after.append(text + m, end - start - m);
+            wordDelta += wordStarts(prevAfter, after.data(), after.size()) - wordStarts(prev, text, end - start);
+        }
+
+        // Where each replacement lands, and where the cursor ends up
+        size_t cursorBefore = cursorOffset(), cursorAfter = cursorBefore;
+        vector<size_t> landed(count);
+        for (size_t i = 0; i < count; ++i) {
+            landed[i] = positions[i] + i * r - i * m;
+            if (positions[i] + m <= cursorBefore) cursorAfter = cursorBefore + (i + 1) * r - (i + 1) * m;
+            else if (positions[i] < cursorBefore) cursorAfter = landed[i] + r;
+        }
+
+        string oldText, newText;
+        if (wholeSpan) {
+            oldText.reserve(oldSpan);
+            document.copy(first, oldSpan, oldText);
+        }
+        document.splice(positions, m, replacement);
+        totalWords += wordDelta;
+
+        history.closeGroup();
+        if (wholeSpan) {
+            newText.reserve(newSpan);
+            document.copy(first, newSpan, newText);
+            history.record(false, first, oldText.data(), oldSpan, cursorBefore, cursorAfter);
+            history.record(true, first, newText.data(), newSpan, cursorBefore, cursorAfter);
+            if (journal) {
+                journal->record(false, first, oldText.data(), oldSpan);
+                journal->record(true, first, newText.data(), newSpan);
+            }
+        } else {
+            for (size_t i = 0; i < count; ++i) {
+                history.record(false, landed[i], matched[i].data(), m, cursorBefore, cursorAfter);
+                if (journal) journal->record(false, landed[i], matched[i].data(), m);
+                if (r == 0) continue;
+                history.record(true, landed[i], replacement.data(), r, cursorBefore, cursorAfter);
+                if (journal) journal->record(true, landed[i], replacement.data(), r);
+            }
+        }
+        history.closeGroup();
+        setCursorOffset(cursorAfter);
+        return count;
+    }
+
+    // Keys while reading a search (Ctrl + F) or its replacement (Ctrl + A).
+    // Returns false for a key that ends the search and should then be
+    // handled as usual.
+    bool handleFindKey(int ch) {
+        if (replaceMode) {
+            if (ch == 13) {
+                size_t count = replaceAll(replaceInput);
+                notice = "Replaced " + to_string(count) + (count == 1 ? " match" : " matches");
+                replaceMode = findMode = false;
+            } else if (ch == 27) {
+                replaceMode = false;           // Back to the search
+            } else if (ch == 8) {
+                if (!replaceInput.empty()) replaceInput.pop_back();
+            } else if (ch >= 32 && ch < 127) {
+                replaceInput += (char)ch;
+            }
+            return true;
+        }
+        if (ch >= 32 && ch < 127) {              // Search as the query is typed
+            findInput += (char)ch;
+            findFrom(findOrigin);
+        } else if (ch == 8) {
+            if (!findInput.empty()) findInput.pop_back();
+            findFrom(findOrigin);
+        } else if (ch == 13 || ch == 6) {        // Enter or Ctrl + F: next match
+            findFrom(matchPos == string::npos ? findOrigin : matchPos + 1);
+        } else if (ch == 20) {                   // Ctrl + T: match case
+            findOptions.ignoreCase = !findOptions.ignoreCase;
+            findFrom(findOrigin);
+        } else if (ch == 23) {                   // Ctrl + W: whole words only
+            findOptions.wholeWord = !findOptions.wholeWord;
+            findFrom(findOrigin);
+        } else if (ch == 1) {                    // Ctrl + A: replace every match
+            if (!findInput.empty()) {
+                replaceMode = true;
+                replaceInput.clear();
+            }
+        } else if (ch == 27) {                   // ESC leaves the cursor on the match
+            findMode = false;
+        } else {
+            findMode = false;
+            return false;
+        }
+        return true;
+    }
+
+    // Backspace (delete character before the cursor)
+    void backspace() {
+        if (cursorPosX > 0) {
+            eraseText(cursorOffset() - 1, 1, cursorOffset() - 1);
+            cursorPosX--;
+        } else if (currentLine > 0) {
+            size_t newline = currentLineStart - 1;
+            eraseText(newline, 1, newline);              // Merge the current line into the previous line
+            currentLine--;                               // Move to the previous line
+            currentLineStart = document.lineStart(currentLine);
+            cursorPosX = newline - currentLineStart;     // Move cursor to where the lines were joined
+            cursorPosY = max(cursorPosY - 1, 0);
+        }
+    }
+
+    // Delete (delete character after the cursor)
+    void deleteChar() {
+        if (cursorPosX < currentLineLength()) {
+            eraseText(cursorOffset(), 1, cursorOffset());
+        }
+    }
+
+    // Insert a newline, the next character typed will be capitalized
+    void insertCapitalNewLine() {
+        insertText(cursorOffset(), "\n", cursorOffset() + 1); // Text after the cursor moves down
+        history.closeGroup();
+        currentLineStart = cursorOffset() + 1;
+        currentLine++;                       // Move to the next line
+        cursorPosX = 0;                      // Reset cursor position
+        cursorPosY++;                        // Move cursor to the next line
+    }
+
+    // Undo the last operation
+    void undo() {
+        size_t cursor;
+        if (history.undo([this](const EditOp& op, bool forward) { applyEdit(op, forward); }, cursor)) { // Reverse the newest group of edits
+            setCursorOffset(cursor);
+        }
+    }
+
+    // Redo the last undone operation
+    void redo() {
+        size_t cursor;
+        if (history.redo([this](const EditOp& op, bool forward) { applyEdit(op, forward); }, cursor)) { // Re-apply the last undone group
+            setCursorOffset(cursor);
+        }
+    }
+
+    // Save the content of the text editor to a file. The saver writes a
+    // snapshot of the document in the background; [modified] clears once it
+    // reports back. Replacing the file by rename also keeps the old file
+    // intact for the unedited parts of the document still mapped from it.
+    void save() {
+        if (savedOnce && history.generation() == queuedGeneration) return;  // Written or on its way
+        history.closeGroup();  // Later typing must not extend the group that was saved
+        queuedGeneration = history.generation();
+        if (journal && openedFile) {
+            // The saved file becomes the journal's new starting point
+            uint64_t marker = journal->mark();
+            EditJournal* log = journal.get();
+            // The save goes ahead without its checkpoint; the status line
+            // shows that the journal failed
+            saver.save(document, filePath, "", queuedGeneration, marker, [log, marker](const struct stat& info) {
+                log->checkpointed(marker, EditJournal::BASE_FILE, info);
+                return true;
+            });
+        } else {
+            saver.save(document, filePath, openedFile ? "" : "\n", queuedGeneration);
+        }
+        savedOnce = true;
+        lastSave = chrono::steady_clock::now();
+    }
+
+    // Once the journal has grown past checkpointAfter, write the document
+    // to the checkpoint file so the journal can be cut back to the edits
+    // made after it
+    void checkpointJournal() {
+        if (!journal || checkpointMarker || journal->size() < checkpointAfter || !journal->intact()) return;
+        uint64_t marker = journal->mark();
+        EditJournal* log = journal.get();
+        checkpointMarker = marker;
+        // Without its record on disk the old checkpoint file must stay
+        saver.save(document, EditJournal::checkpointPath(filePath), "", history.generation(), marker,
+                   [log, marker](const struct stat& info) { return log->checkpointed(marker, EditJournal::BASE_CHECKPOINT, info); });
+    }
+
+    // Take the outcome of finished saves; true if the status line changed
+    bool collectSaves() {
+        BackgroundSaver::Result result;
+        bool changed = false;
+        while (saver.nextResult(result)) {
+            if (result.ok && result.marker) journal->compact(result.marker);
+            if (result.marker && result.marker == checkpointMarker) {
+                checkpointMarker = 0;
+                checkpointAfter = result.ok ? JOURNAL_CHECKPOINT_BYTES : journal->size() + JOURNAL_CHECKPOINT_BYTES;
+                continue;
+            }
+            if (result.ok) savedGeneration = result.generation;
+            else if (result.generation == queuedGeneration) queuedGeneration = savedGeneration;  // Let Ctrl + S try again
+            saveFailed = !result.ok;
+            changed = true;
+        }
+        return changed;
+    }
+
+    // Milliseconds until an autosave is due, or -1 if none is
+    int msUntilAutosave() const {
+        if (autosaveInterval.count() == 0 || history.generation() == queuedGeneration) return -1;
+        auto waited = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - lastSave);
+        return max<int>(0, chrono::duration_cast<chrono::milliseconds>(autosaveInterval).count() - waited.count());
+    }
+
+    // The live word count, kept up to date by every edit
+    long long int word_count() const {
+        return totalWords;
+    }
+
+    // Milliseconds until display_word_count() has something to write, or -1 if nothing is due
+    int msUntilWordCountExport() const {
+        if (totalWords == exportedWords) return -1;
+        auto waited = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - lastExport);
+        return max<int>(0, WORD_COUNT_EXPORT_MS - waited.count());
+    }
+
+    // Write the word count to word_count.txt, at most once every WORD_COUNT_EXPORT_MS.
+    // Called on every pass of the input loop so a skipped update lands shortly after.
+    void display_word_count() {
+        if (totalWords == exportedWords) return;  // File is already up to date
+        auto now = chrono::steady_clock::now();
+        if (now - lastExport < chrono::milliseconds(WORD_COUNT_EXPORT_MS)) return;
+        StageTimer timer(STAGE_WORD_COUNT);
+        exportedWords = totalWords;
+        lastExport = now;
+        FILE* fp;
+        fp = fopen("word_count.txt", "w");
+        if (!fp) {
+            cout << "File did not open" << endl;
+            exit(1);
+        }
+        fprintf(fp, "Current Word Count: %lld", totalWords);  // Store the live word count
+        fclose(fp);
+    }
+
+    // Draw the text in one of the console colours from now on
+    void setTextColor(int color) {
+        textColor = ansiColor(color);
+        screen.invalidate();  // Every row starts with the text colour
+    }
+
+    // Finish the word before the cursor with its best completion
+    bool autoComplete() {
+        string word = bestCompletion();
+        if (word.empty()) return false;
+        completions.took(word);
+
+        // Only the missing tail of the completion has to be typed in
+        string tail = word.substr(typing.partial().size());
+        history.closeGroup();
+        insertText(cursorOffset(), tail, cursorOffset() + tail.size());
+        history.closeGroup();
+        cursorPosX += tail.size();
+        return true;
+    }
+
+    // Apply a bracketed paste. With a prompt open, its first line is typed
+    // into the prompt for as long as the prompt stays open.
+    void handlePaste(const string& pasted) {
+        if (!findMode && !gotoMode) {
+            StageTimer timer(STAGE_KEY);
+            notice.clear();
+            pasteText(pasted);
+            return;
+        }
+        for (size_t i = 0; i < pasted.size() && pasted[i] != '\r' && pasted[i] != '\n'; ++i) {
+            if (!findMode && !gotoMode) break;
+            unsigned char c = pasted[i];
+            if (c >= 32 && c != 127) handleKey(c);
+        }
+    }
+
+    // Apply one key; special keys (224) come with their scan code.
+    // Returns false when the key asks the editor to exit.
+    bool handleKey(int ch, int scanCode = 0) {
+        StageTimer timer(STAGE_KEY);
+        notice.clear();
+        if (findMode && handleFindKey(ch)) return true;
+        if (gotoMode) {  // Collecting the line number for Ctrl + G
+            if (isdigit(ch)) {
+                gotoInput += (char)ch;
+                return true;
+            }
+            gotoMode = false;
+            if (ch == 13 && !gotoInput.empty()) {
+                // strtoull saturates where stoi would throw on a long number;
+                // anything past the end lands on the last line
+                unsigned long long line = strtoull(gotoInput.c_str(), nullptr, 10);
+                goToLine((int)min<unsigned long long>(line, document.lineCount()) - 1);
+            }
+            return true;    // Any other key cancels
+        }
+
+        if (ch == 224) {  // Special keys (arrows, delete)
+            switch (scanCode) {
+                case 75: // Left arrow key
+                    moveCursorLeft();
+                    break;
+                case 77: // Right arrow key
+                    moveCursorRight();
+                    break;
+                case 72: // Up arrow key
+                    moveCursorUp();
+                    break;
+                case 80: // Down arrow key
+                    moveCursorDown();
+                    break;
+                case 83: // Delete key (ASCII code 83)
+                    deleteChar();
+                    break;
+            }
+        }
+        else if (ch == 8) {  // Backspace
+            backspace();
+        }
+        else if (ch == 13) {  // Enter key
+            insertCapitalNewLine();
+        }
+        else if (ch == 26) {  // Ctrl + Z (Undo)
+            undo();
+        }
+        else if (ch == 25) {  // Ctrl + Y (Redo)
+            redo();
+        }
+        else if (ch == 19) {  // Ctrl + S (Save)
+            save();
+        }
+        else if (ch == 7) {  // Ctrl + G (Go to line), followed by the line number and Enter
+            gotoMode = true;
+            gotoInput.clear();
+        }
+        else if (ch == 6) {  // Ctrl + F (Find), search as you type; Ctrl + A in it replaces all
+            findMode = true;
+            findInput.clear();
+            findOrigin = cursorOffset();
+            matchPos = string::npos;
+        }
+        else if (ch == 27) {  // ESC key to exit
+            return false;
+        }
+        else if (ch == 4) {  // Ctrl + D (Add the word before the cursor to the dictionary)
+            addCurrentWord();
+        }
+        else if (ch == 20) {  // Ctrl + T (Latency stats), starts timing keys or writes the timings
+            requestLatency();
+        }
+        else if (ch == 18) {    // Ctrl + R (Change Colour)
+            currentColor++;   // Move to next colour in the palette
+            if (currentColor == ThemeColors.end()) currentColor = ThemeColors.begin();
+            setTextColor(*currentColor);      // Set colour to next colour
+        }
+        else if (ch == 32) {  // Space for autocorrect
+            checkSpelling();  // Checked in the background, the verdict shows on a later frame
+            insert_capital(' ');
+        }
+        else if (ch == 9) { // TAB key for autocomplete
+            checkSpelling();
+            autoComplete();
+        }
+        else {  // Regular character input
+            insert_capital(ch);  // Insert character with capitalization if needed
+        }
+        return true;
+    }
+
+    // Start timing keys the first time, then write the stats to latencyPath
+    // each time after that
+    void requestLatency() {
+        if (!latencyStats.enabled()) {
+            latencyStats.enable();
+            notice = "Timing keys, Ctrl + T writes " + latencyPath;
+        } else if (latencyStats.dump(latencyPath)) {
+            notice = "Latency written to " + latencyPath;
+        } else {
+            notice = "Could not write " + latencyPath;
+        }
+    }
+
+    // Time keys from the start, writing the stats to path on request and on exit
+    void timeKeysTo(const string& path) {
+        latencyPath = path;
+        latencyStats.enable();
+    }
+
+    // Write every key typed to path as a trace for replay()
+    bool recordTo(const string& path) {
+        recording.open(path);
+        return recording.is_open();
+    }
+
+    // Apply the keys of a trace with no terminal, timing each one. The final
+    // text goes to out and the time each kind of key took to report. Stops
+    // early at a key that would exit the editor.
+    void replay(const vector<TraceEvent>& events, FILE* out, FILE* report) {
+        map<string, vector<double>> timings;   // Microseconds per key, by kind of key
+        vector<double> all;
+        all.reserve(events.size());
+        size_t applied = 0;
+        for (const TraceEvent& event : events) {
+            auto start = chrono::steady_clock::now();
+            bool running = true;
+            if (event.code == PASTE_KEY) handlePaste(event.text);
+            else running = handleKey(event.code, event.scanCode);
+            double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+            timings[keyName(event)].push_back(us);
+            all.push_back(us);
+            applied++;
+            if (!running) break;
+        }
+        saver.finish();
+        while (countingFile && !collectWordCount()) this_thread::sleep_for(chrono::milliseconds(1));
+
+        document.forEachChunk([out](const char* data, size_t len) {
+            fwrite(data, 1, len, out);
+        });
+        fflush(out);
+
+        fprintf(report, "%-14s %8s %12s %10s %10s %10s %10s\n", "key", "count", "total ms", "mean us", "p50 us", "p99 us", "max us");
+        auto row = [report](const string& name, vector<double>& us) {
+            if (us.empty()) return;
+            sort(us.begin(), us.end());
+            double total = accumulate(us.begin(), us.end(), 0.0);
+            fprintf(report, "%-14s %8zu %12.3f %10.2f %10.2f %10.2f %10.2f\n", name.c_str(), us.size(), total / 1000,
+                    total / us.size(), us[us.size() / 2], us[min(us.size() - 1, us.size() * 99 / 100)], us.back());
+        };
+        for (auto& kind : timings) row(kind.first, kind.second);
+        row("all", all);
+        fprintf(report, "%zu of %zu keys applied; %zu bytes, %zu lines, %lld words\n", applied, events.size(),
+                document.size(), document.lineCount(), totalWords);
+        if (latencyStats.enabled() && !latencyStats.dump(latencyPath)) fprintf(report, "Could not write %s\n", latencyPath.c_str());
+    }
+
+    // Main function to handle real-time editing. The loop sleeps in poll()
+    // until a key arrives, applies every key that is already waiting as one
+    // batch, and then draws at most one frame per FRAME_INTERVAL_MS.
+    void runEditor() {
+        terminal.enableRawMode();
+        terminal.windowSize(screenRows, screenCols);
+        signal(SIGUSR1, onLatencyRequest);
+        signal(SIGUSR2, onReloadRequest);
+        displayText();
+
+        auto nextFrame = chrono::steady_clock::now();
+        bool needsRedraw = false;
+        bool running = true;
+        uint64_t keyRead = 0, keyAllocations = 0;   // When the oldest key not yet drawn was read, if timing keys
+        while (running) {
+            // Sleep until input, the next allowed frame or the word count export is due
+            int timeout = msUntilWordCountExport();
+            if (countingFile) timeout = timeout < 0 ? 100 : min(timeout, 100);  // Look for the end of the word count scan
+            int autosave = msUntilAutosave();
+            if (autosave >= 0) timeout = timeout < 0 ? autosave : min(timeout, autosave);
+            if (needsRedraw) {
+                auto untilFrame = chrono::duration_cast<chrono::milliseconds>(nextFrame - chrono::steady_clock::now());
+                int frameWait = max<int>(0, untilFrame.count());
+                timeout = timeout < 0 ? frameWait : min(timeout, frameWait);
+            }
+
+            if (terminal.waitForInput(timeout, {spellChecker.resultFd(), saver.resultFd(), learner.resultFd()})) {
+                uint64_t readAt = latencyStats.enabled() ? latencyTicks() : 0;
+                uint64_t allocationsAt = threadAllocations.value();
+                terminal.readAvailable();
+                int ch, scanCode;
+                while (running && terminal.nextKey(ch)) {
+                    scanCode = 0;
+                    if (ch == 224 && !terminal.nextKey(scanCode)) break;
+                    if (!keyRead) {
+                        keyRead = readAt;
+                        keyAllocations = allocationsAt;
+                    }
+                    if (recording) {
+                        TraceEvent event;
+                        event.code = ch;
+                        event.scanCode = scanCode;
+                        if (ch == PASTE_KEY) event.text = terminal.pastedText();
+                        recording << traceLine(event) << '\n';
+                    }
+                    if (ch == PASTE_KEY) handlePaste(terminal.pastedText());
+                    else running = handleKey(ch, scanCode);
+                    needsRedraw = true;
+                }
+            }
+            if (reloadRequested) {
+                reloadRequested = 0;
+                wordBase.reload();   // Picked up by collectSpelling() once it is built
+            }
+            if (latencyRequested) {
+                latencyRequested = 0;
+                requestLatency();
+                needsRedraw = true;
+            }
+            if (windowResized) needsRedraw = true;
+            if (collectSpelling()) needsRedraw = true;  // New misspelling markers to draw
+            if (collectWordCount()) needsRedraw = true;
+            if (collectTerms()) needsRedraw = true;     // The completion hint may change
+            if (collectSaves()) needsRedraw = true;
+            if (running && msUntilAutosave() == 0) save();
+            checkpointJournal();
+
+            display_word_count();  // Export the word count once the throttle allows
+            auto now = chrono::steady_clock::now();
+            if (running && needsRedraw && now >= nextFrame) {
+                displayText();  // Redraw the rows that changed and place the cursor
+                needsRedraw = false;
+                if (keyRead) {
+                    latencyStats.record(STAGE_KEY_TO_PAINT, latencyTicks() - keyRead, threadAllocations.value() - keyAllocations);
+                    keyRead = 0;
+                }
+                nextFrame = now + chrono::milliseconds(FRAME_INTERVAL_MS);
+            }
+        }
+
+        terminal.disableRawMode();   // Revert to original colour and screen
+        recording.close();
+        if (latencyStats.enabled()) latencyStats.dump(latencyPath);
+        saver.finish();              // Let the last save land before the journal goes
+        if (journal) journal->close(true);
+        FILE *fp;
+        fp = fopen("word_count.txt", "w");
+        if (!fp) {
+            cout << "File did not open" << endl;
+            exit(1);
+        }
+        fprintf(fp, "Current Word Count: %d", 0);  // Clear the word count to zero again.
+        fclose(fp);
+    }
+};
+
+// Benchmarks
+
+// Start a new peak for peakMemoryKB(). Only Linux can do this; elsewhere
+// the peak covers the whole run.
+void resetPeakMemory() {
+    int fd = ::open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0) return;
+    if (::write(fd, "5", 1) < 0) {}  // Unsupported kernels keep the old peak
+    close(fd);
+}
+
+// Peak resident memory in KB
+long peakMemoryKB() {
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) return atol(line.c_str() + 6);
+    }
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Runs named benchmarks and writes the results as JSON, one benchmark per
+// line: time and allocations per operation, and the peak resident memory
+// while it ran
+class BenchmarkReport {
+private:
+    FILE* out;
+    string filter;     // Only benchmarks whose name contains this run
+    bool first = true;
+    long peak = 0;     // Highest peak of any benchmark, as each resets it
+
+public:
+    BenchmarkReport(FILE* out, const string& filter) : out(out), filter(filter) {
+        fprintf(out, "{\"benchmarks\": [\n");
+    }
+
+    ~BenchmarkReport() {
+        fprintf(out, "\n], \"peak_rss_kb\": %ld}\n", max(peak, peakMemoryKB()));
+        fflush(out);
+    }
+
+    bool wanted(const string& name) const {
+        return name.find(filter) != string::npos;
+    }
+
+    bool anyWanted(const vector<string>& names) const {
+        return any_of(names.begin(), names.end(), [this](const string& name) { return wanted(name); });
+    }
+
+    // Time ops calls of step(i). Extra fields for the result, such as memory
+    // held afterwards, come from extra(). False if the filter skipped it.
+    template <typename Step, typename Extra>
+    bool run(const string& name, size_t ops, Step step, Extra extra) {
+        if (!wanted(name)) return false;
+        resetPeakMemory();
+        uint64_t allocations = AllocationCounter::total();
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < ops; ++i) step(i);
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        allocations = AllocationCounter::total() - allocations;
+        long used = peakMemoryKB();
+        peak = max(peak, used);
+        fprintf(out, "%s  {\"name\": \"%s\", \"ops\": %zu, \"ns_per_op\": %.1f, \"allocs_per_op\": %.3f, \"peak_rss_kb\": %ld",
+                first ? "" : ",\n", name.c_str(), ops, ns / ops, (double)allocations / ops, used);
+        for (auto& field : extra()) fprintf(out, ", \"%s\": %.0f", field.first.c_str(), field.second);
+        fprintf(out, "}");
+        fflush(out);
+        first = false;
+        return true;
+    }
+
+    template <typename Step>
+    bool run(const string& name, size_t ops, Step step) {
+        return run(name, ops, step, [] { return vector<pair<string, double>>(); });
+    }
+};
+
+// Lowercase words of 3 to 12 letters
+vector<string> syntheticWords(size_t count, mt19937& random) {
+    vector<string> words(count);
+    for (auto& word : words) {
+        size_t length = 3 + random() % 10;
+        for (size_t i = 0; i < length; ++i) word += (char)('a' + random() % 26);
+    }
+    return words;
+}
+
+// Write about bytes of sentences, in lines of about 60 characters, to a
+// new temporary file and return its path
+string syntheticDocument(size_t bytes, mt19937& random) {
+    static const char* words[] = {"the", "editor", "keeps", "every", "line", "of", "text", "in", "a", "rope",
+                                  "and", "draws", "only", "what", "changed", "since", "last", "frame"};
+    char path[] = "/tmp/texted-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) return "";
+    string block, line;
+    size_t written = 0;
+    while (written < bytes) {
+        line += words[random() % 18];
+        line += random() % 8 == 0 ? ". " : " ";
+        if (line.size() < 60) continue;
+        line.back() = '\n';
+        block += line;
+        line.clear();
+        if (block.size() >= (1 << 20) || written + block.size() >= bytes) {
+            block.resize(min(block.size(), bytes - written));
+            if (::write(fd, block.data(), block.size()) != (ssize_t)block.size()) break;
+            written += block.size();
+            block.clear();
+        }
+    }
+    close(fd);
+    return path;
+}
+
+// texted --bench: dictionary, editing, undo and drawing costs
+void runBenchmarks(const string& filter, FILE* out) {
+    BenchmarkReport report(out, filter);
+    mt19937 random(42);
+
+    // Dictionary: loading the real word list, then a synthetic million words
+    if (report.anyWanted({"dict/initialize", "dict/load_wordlist"})) {
+        uint64_t size;
+        int64_t modified;
+        if (fileStamp("dictionary.txt", size, modified)) {
+            report.run("dict/initialize", 1, [](size_t) {
+                Dictionary dict;
+                initializeDictionary(dict, "dictionary.txt");
+            });
+            report.run("dict/load_wordlist", 1, [](size_t) {
+                Dictionary dict;
+                loadWordList(dict, "dictionary.txt");
+            });
+        } else {
+            cerr << "No dictionary.txt here, skipping dict/initialize and dict/load_wordlist" << endl;
+        }
+    }
+    if (report.anyWanted({"dict/load_wordlist_1m", "dict/add_word_1m", "dict/build_1m", "dict/exists", "dict/suggest", "dict/corrections"})) {
+        const size_t count = 1000000;
+        vector<string> words = syntheticWords(count, random);
+        char path[] = "/tmp/texted-bench-XXXXXX";
+        int fd = mkstemp(path);
+        if (fd >= 0) {
+            string list;
+            for (auto& word : words) list += word + "\n";
+            bool written = ::write(fd, list.data(), list.size()) == (ssize_t)list.size();
+            close(fd);
+            if (written) {
+                report.run("dict/load_wordlist_1m", 1, [&](size_t) {
+                    Dictionary dict;
+                    loadWordList(dict, path);
+                });
+            }
+            unlink(path);
+        }
+
+        Dictionary dict;
+        auto add = [&](size_t i) {
+            dict.addWord(words[i], 1 + i % 1000);
+        };
+        if (!report.run("dict/add_word_1m", count, add)) {
+            for (size_t i = 0; i < count; ++i) add(i);
+        }
+        report.run("dict/build_1m", 1, [&](size_t) {
+            dict.build();
+        }, [&] { return vector<pair<string, double>>{{"dictionary_bytes", (double)dict.memoryUsage()}}; });
+        dict.build();   // In case build_1m was filtered out
+
+        size_t found = 0;
+        report.run("dict/exists", count, [&](size_t i) {
+            string word = words[(i * 7919) % count];
+            if (i % 2) word.back() = 'a' + (word.back() - 'a' + 1) % 26;   // Mostly not a word
+            found += dict.exists(word);
+        });
+        report.run("dict/suggest", 100000, [&](size_t i) {
+            const string& word = words[(i * 7919) % count];
+            dict.suggest(word.substr(0, 1 + i % 4));
+        });
+        report.run("dict/corrections", 2000, [&](size_t i) {
+            string word = words[(i * 7919) % count];
+            word.erase(word.size() / 2, 1);
+            dict.corrections(word);
+        });
+        if (found == 0) cerr << "dict/exists found nothing" << endl;
+    }
+
+    // Editing keys on documents of three sizes, at the middle line
+    const pair<const char*, size_t> sizes[] = {{"1KB", 1 << 10}, {"1MB", 1 << 20}, {"100MB", 100 << 20}};
+    for (auto& size : sizes) {
+        string prefix = string("buffer/") + size.first + "/";
+        if (!report.anyWanted({prefix + "insert", prefix + "backspace", prefix + "newline", prefix + "cursor"})) continue;
+        string path = syntheticDocument(size.second, random);
+        if (path.empty()) continue;
+        {
+            text_ed editor;
+            editor.open(path);
+            editor.goToLine(editor.document.lineCount() / 2);
+            const size_t ops = 100000;
+            report.run(prefix + "insert", ops, [&](size_t) {
+                editor.handleKey('a');
+            });
+            report.run(prefix + "backspace", ops, [&](size_t) {
+                editor.handleKey(8);
+            });
+            report.run(prefix + "newline", ops, [&](size_t) {
+                editor.handleKey(13);
+            });
+            static const int moves[] = {72, 80, 75, 77, 80, 72, 77, 75};   // Up, down, left, right and back
+            report.run(prefix + "cursor", ops, [&](size_t i) {
+                editor.handleKey(224, moves[i % 8]);
+            });
+        }
+        unlink(path.c_str());
+    }
+
+    // Undo and redo of typed words (one step each) and of a 1MB paste
+    if (report.anyWanted({"undo/undo_word", "undo/redo_word", "undo/undo_redo_paste_1MB"})) {
+        text_ed editor;
+        const size_t words = 10000;
+        for (size_t i = 0; i < words; ++i) {
+            for (char c : string("word ")) editor.handleKey(c);
+        }
+        auto held = [&] { return vector<pair<string, double>>{{"history_bytes", (double)editor.history.bytes()}}; };
+        report.run("undo/undo_word", words, [&](size_t) {
+            editor.undo();
+        }, held);
+        report.run("undo/redo_word", words, [&](size_t) {
+            editor.redo();
+        }, held);
+        string paste;
+        while (paste.size() < (1 << 20)) paste += "pasted text. ";
+        editor.pasteText(paste);
+        report.run("undo/undo_redo_paste_1MB", 100, [&](size_t) {
+            editor.undo();
+            editor.redo();
+        }, held);
+    }
+
+    // Drawing a 24 x 80 screen of a 1MB document
+    if (report.anyWanted({"render/frame_full", "render/frame_after_key", "render/frame_scroll"})) {
+        string path = syntheticDocument(1 << 20, random);
+        if (!path.empty()) {
+            text_ed editor;
+            editor.open(path);
+            editor.goToLine(editor.document.lineCount() / 2);
+            size_t bytes = 0;
+            report.run("render/frame_full", 2000, [&](size_t) {
+                editor.screen.invalidate();
+                bytes += editor.renderFrame().size();
+            });
+            report.run("render/frame_after_key", 2000, [&](size_t i) {
+                editor.handleKey(i % 2 ? 8 : 'a');
+                bytes += editor.renderFrame().size();
+            });
+            report.run("render/frame_scroll", 2000, [&](size_t i) {
+                editor.handleKey(224, (i / 100) % 2 ? 72 : 80);   // 100 lines down, 100 back up
+                bytes += editor.renderFrame().size();
+            });
+            if (bytes == 0) cerr << "render wrote nothing" << endl;
+            unlink(path.c_str());
+        }
+    }
+
+    // Completion: learning the words of a 1MB document, then ranking the
+    // completions of a prefix as a key is typed
+    if (report.anyWanted({"complete/learn_1mb", "complete/query"})) {
+        string path = syntheticDocument(1 << 20, random);
+        shared_ptr<MappedFile> file = path.empty() ? nullptr : MappedFile::open(path);
+        if (file) {
+            Rope text;
+            text.load(file);
+            CompletionIndex index;
+            report.run("complete/learn_1mb", 1, [&](size_t) {
+                TermScanner scanner(&index.documentTerms());
+                text.forEachChunk([&scanner](const char* data, size_t len) { scanner.feed(data, len); });
+                scanner.finish();
+            }, [&] { return vector<pair<string, double>>{{"terms", (double)index.documentTerms().size()}}; });
+            const vector<string> prefixes = {"ed", "ke", "ev", "li", "te", "ro", "dr", "wh", "ch", "si", "la", "fr"};
+            size_t found = 0;
+            report.run("complete/query", 100000, [&](size_t i) {
+                found += index.complete(prefixes[i % prefixes.size()], "the", 5).size();
+            });
+            if (found == 0) cerr << "complete/query found nothing" << endl;
+        }
+        if (!path.empty()) unlink(path.c_str());
+    }
+
+    // Queries to a --serve over its socket: one at a time, and pipelined
+    if (report.anyWanted({"server/exists_round_trip", "server/suggest_round_trip", "server/exists_batch_64"})) {
+        const size_t count = 100000;
+        vector<string> words = syntheticWords(count, random);
+        shared_ptr<Dictionary> dict = make_shared<Dictionary>();
+        for (size_t i = 0; i < count; ++i) dict->addWord(words[i], 1 + i % 1000);
+        dict->build();
+        DictionaryStore store;
+        store.use(dict);
+        SpellServer server(store);
+        SpellClient client;
+        string socketPath = "/tmp/texted-bench-" + to_string(getpid()) + ".sock", error;
+        if (server.start(socketPath, SERVE_MAX_THREADS, error) && client.connect(socketPath)) {
+            SpellAnswer answer;
+            size_t found = 0;
+            report.run("server/exists_round_trip", 100000, [&](size_t i) {
+                client.ask(QUERY_EXISTS, words[(i * 7919) % count]);
+                if (client.nextAnswer(answer)) found += answer.exists;
+            });
+            report.run("server/suggest_round_trip", 100000, [&](size_t i) {
+                client.ask(QUERY_SUGGEST, words[(i * 7919) % count].substr(0, 1 + i % 4));
+                client.nextAnswer(answer);
+            });
+            const size_t batch = 64;
+            report.run("server/exists_batch_64", 100000 * batch, [&](size_t i) {
+                if (i % batch) return;
+                for (size_t j = 0; j < batch; ++j) client.ask(QUERY_EXISTS, words[((i + j) * 7919) % count]);
+                for (size_t j = 0; j < batch; ++j) found += client.nextAnswer(answer) && answer.exists;
+            });
+            if (found == 0) cerr << "server/exists found nothing" << endl;
+        } else {
+            cerr << "Could not start the benchmark server: " << error << endl;
+        }
+    }
+
+    // Reading through a dictionary snapshot, and adding user words beside it
+    if (report.anyWanted({"snapshot/read_exists", "snapshot/add_word"})) {
+        const size_t count = 100000;
+        vector<string> words = syntheticWords(count, random);
+        shared_ptr<Dictionary> dict = make_shared<Dictionary>();
+        for (size_t i = 0; i < count; ++i) dict->addWord(words[i], 1 + i % 1000);
+        dict->build();
+        DictionaryStore store;
+        store.use(dict);
+        size_t found = 0;
+        report.run("snapshot/read_exists", 1000000, [&](size_t i) {
+            found += store.read()->exists(words[(i * 7919) % count]);
+        });
+        if (found == 0) cerr << "snapshot/read_exists found nothing" << endl;
+        vector<string> userWords = syntheticWords(USER_WORDS_MERGE - 1, random);   // Short of a merge
+        size_t added = 0;
+        report.run("snapshot/add_word", userWords.size(), [&](size_t i) {
+            added += store.addWord("zq" + userWords[i]);
+        });
+        if (added == 0) cerr << "snapshot/add_word added nothing" << endl;
+    }
+
+    // What timing one stage costs with latency stats off and on
+    if (report.anyWanted({"latency/stage_off", "latency/stage_on"})) {
+        bool wasOn = latencyStats.enabled();
+        report.run("latency/stage_off", 10000000, [](size_t) {
+            StageTimer timer(STAGE_KEY);
+        });
+        latencyStats.enable();
+        report.run("latency/stage_on", 10000000, [](size_t) {
+            StageTimer timer(STAGE_KEY);
+        });
+        if (!wasOn) latencyStats.disable();
+    }
+}
+
+int main(int argc, char* argv[]) {
+    vector<string> args(argv + 1, argv + argc);
+    // --suggestions N: how many ranked completions to keep per prefix
+    auto option = find(args.begin(), args.end(), "--suggestions");
+    if (option != args.end() && option + 1 != args.end()) {
+        wordBase.setSuggestionCount(atoi((option + 1)->c_str()));
+        args.erase(option, option + 2);
+    }
+
+    // texted --build-dict [words.txt [image]]: compile a word list into a dictionary image
+    if (!args.empty() && args[0] == "--build-dict") {
+        string words = args.size() >= 2 ? args[1] : "dictionary.txt";
+        string image = args.size() >= 3 ? args[2] : dictionaryImagePath(words);
+        Dictionary dict;
+        dict.setSuggestionCount(wordBase.suggestionCount());
+        if (!buildDictionaryImage(dict, words, image)) {
+            cerr << "Could not build " << image << " from " << words << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // texted --query [socket]: ask a running --serve about the words on
+    // standard input, without loading a dictionary here
+    if (!args.empty() && args[0] == "--query") {
+        return runQueries(args.size() >= 2 ? args[1] : "texted.sock", cin, stdout) ? 0 : 1;
+    }
+
+    wordBase.load("dictionary.txt", "user_words.txt");  // Load words from dictionary.txt and the user's own
+
+    // texted --serve [socket]: answer spellcheck queries from other programs
+    // until interrupted, so they can share this dictionary
+    if (!args.empty() && args[0] == "--serve") {
+        return serveDictionary(wordBase, args.size() >= 2 ? args[1] : "texted.sock") ? 0 : 1;
+    }
+
+    // texted --check [files...]: spellcheck text headlessly, reading standard input if no files are given
+    if (!args.empty() && args[0] == "--check") {
+        static char buffer[1 << 20];
+        setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+        return checkFiles(*wordBase.read(), vector<string>(args.begin() + 1, args.end()), stdout) ? 0 : 1;
+    }
+
+    // texted --bench [filter]: time the editor's parts, printing JSON; filter
+    // picks the benchmarks whose names contain it
+    if (!args.empty() && args[0] == "--bench") {
+        runBenchmarks(args.size() >= 2 ? args[1] : "", stdout);
+        return 0;
+    }
+
+    // --autosave SECONDS: save unsaved changes in the background this often
+    int autosaveSeconds = 0;
+    option = find(args.begin(), args.end(), "--autosave");
+    if (option != args.end() && option + 1 != args.end()) {
+        autosaveSeconds = atoi((option + 1)->c_str());
+        args.erase(option, option + 2);
+    }
+
+    // --latency FILE: time each stage of handling a key from the start and
+    // write the stats to FILE on Ctrl + T, SIGUSR1 and exit (or after --replay)
+    string latencyPath;
+    option = find(args.begin(), args.end(), "--latency");
+    if (option != args.end() && option + 1 != args.end()) {
+        latencyPath = *(option + 1);
+        args.erase(option, option + 2);
+    }
+
+    // --record TRACE: write every key typed to TRACE, for --replay
+    string recordPath;
+    option = find(args.begin(), args.end(), "--record");
+    if (option != args.end() && option + 1 != args.end()) {
+        recordPath = *(option + 1);
+        args.erase(option, option + 2);
+    }
+
+    // texted --replay TRACE [file]: apply a keystroke trace without a terminal,
+    // printing the final text and a table of how long each kind of key took
+    vector<TraceEvent> trace;
+    bool replaying = !args.empty() && args[0] == "--replay";
+    if (replaying) {
+        string error;
+        if (args.size() < 2 || !readTrace(args[1], trace, error)) {
+            cerr << (args.size() < 2 ? "--replay needs a trace file" : error) << endl;
+            return 1;
+        }
+        args.erase(args.begin(), args.begin() + 2);
+    }
+
+    // texted [file]: edit file, or myDoc.txt when none is given
+    text_ed editor;
+    editor.setAutosave(autosaveSeconds);
+    if (!latencyPath.empty()) editor.timeKeysTo(latencyPath);
+    if (!args.empty() && !editor.open(args[0])) {
+        cerr << "Could not open " << args[0] << endl;
+        return 1;
+    }
+    if (replaying) {
+        editor.replay(trace, stdout, stderr);
+        return 0;
+    }
+    if (!recordPath.empty() && !editor.recordTo(recordPath)) {
+        cerr << "Could not write " << recordPath << endl;
+        return 1;
+    }
+    editor.startJournal();  // Recover from a crash, then journal edits
+    editor.runEditor();  // Start the text editor
+    return 0;
+}